@@ -0,0 +1,562 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Convert recordings made by the rtpproxy in the ad-hoc or PCAP format
+ * into stereo WAV files, caller in the left channel and callee in the
+ * right one. Both legs are read packet by packet and placed according to
+ * their RTP timestamps, anchored to the arrival time, so that they stay
+ * aligned and gaps are filled with silence. Several recordings are
+ * converted at the same time by the pool of threads.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <dirent.h>
+#if defined(HAVE_ERR_H)
+#include <err.h>
+#else
+#include "rtpp_util.h"
+#endif
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "g711.h"
+#include "rtp.h"
+#include "rtpp_record.h"
+
+#if BYTE_ORDER == BIG_ENDIAN
+#define HOST_2_LE16(x) \
+ ((((uint16_t)(x)) >> 8) & 0xff) | ((((uint16_t)(x)) & 0xff) << 8)
+#define HOST_2_LE32(x) \
+ ((HOST_2_LE16((x) & 0xffff) << 16) | HOST_2_LE16(((x) >> 16) & 0xffff))
+#else
+#define HOST_2_LE16(x) (x)
+#define HOST_2_LE32(x) (x)
+#endif
+
+#define EA_RATE         8000
+/* Number of samples per channel written at once */
+#define EA_BLOCK        1024
+/*
+ * Leg is re-anchored to the arrival time if the position derived from RTP
+ * timestamps is this far (in samples) off, i.e. on timestamp jumps.
+ */
+#define EA_RESYNC       EA_RATE
+#define EA_MAXPKT       8192
+
+enum ea_format {EA_ADHOC, EA_PCAP};
+
+struct ea_leg {
+    FILE *f;
+    char path[PATH_MAX + 1];
+    enum ea_format format;
+    /* Raw packet read from the file */
+    unsigned char buf[EA_MAXPKT + 64];
+    unsigned char *data;
+    int len;
+    double rtime;
+    int loaded;
+    /* Decoded packet waiting to be written out */
+    int have;
+    int16_t samples[EA_MAXPKT];
+    int nsamples;
+    int64_t pos;
+    /* Mapping of RTP timestamps to positions in the output */
+    int anchored;
+    uint32_t ssrc;
+    uint32_t base_ts;
+    int64_t base_pos;
+};
+
+struct wav_hdr {
+    char riff[4];
+    uint32_t riff_len;
+    char wave[4];
+    char fmt[4];
+    uint32_t fmt_len;
+    uint16_t format;
+    uint16_t nchannels;
+    uint32_t rate;
+    uint32_t byte_rate;
+    uint16_t block_align;
+    uint16_t bits;
+    char data[4];
+    uint32_t data_len;
+} __attribute__((__packed__));
+
+static char **jobs;
+static int njobs, jobs_size, nextjob, nfailed;
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char *outdir;
+
+static void
+usage(void)
+{
+
+    fprintf(stderr, "usage: extractaudio [-j njobs] [-d outdir] rdir|recording ...\n");
+    exit(1);
+}
+
+static int
+leg_open(struct ea_leg *leg)
+{
+    pcap_hdr_t pcap_hdr;
+
+    leg->f = fopen(leg->path, "r");
+    if (leg->f == NULL)
+        return 0;
+    if (fread(&pcap_hdr, sizeof(pcap_hdr), 1, leg->f) == 1 &&
+      pcap_hdr.magic_number == PCAP_MAGIC) {
+        if (pcap_hdr.network != DLT_NULL) {
+            warnx("%s: unsupported link type %u", leg->path, pcap_hdr.network);
+            return -1;
+        }
+        leg->format = EA_PCAP;
+        return 0;
+    }
+    leg->format = EA_ADHOC;
+    if (fseek(leg->f, 0, SEEK_SET) == -1) {
+        warn("%s", leg->path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Read next packet from the file, 0 is returned at the end of it */
+static int
+leg_read(struct ea_leg *leg)
+{
+    struct pkt_hdr_adhoc adhoc_hdr;
+    pcaprec_hdr_t pcaprec_hdr;
+    struct ip *iphdr;
+    int hlen;
+
+    for (;;) {
+        if (leg->format == EA_ADHOC) {
+            if (fread(&adhoc_hdr, sizeof(adhoc_hdr), 1, leg->f) != 1)
+                return 0;
+            if (adhoc_hdr.plen > EA_MAXPKT ||
+              fread(leg->buf, adhoc_hdr.plen, 1, leg->f) != 1)
+                return -1;
+            leg->data = leg->buf;
+            leg->len = adhoc_hdr.plen;
+            leg->rtime = adhoc_hdr.time;
+            return 1;
+        }
+
+        if (fread(&pcaprec_hdr, sizeof(pcaprec_hdr), 1, leg->f) != 1)
+            return 0;
+        if (pcaprec_hdr.incl_len > sizeof(leg->buf) ||
+          fread(leg->buf, pcaprec_hdr.incl_len, 1, leg->f) != 1)
+            return -1;
+        leg->rtime = pcaprec_hdr.ts_sec + pcaprec_hdr.ts_usec / 1000000.0;
+        /* DLT_NULL family, IPv4 and UDP headers precede the packet */
+        hlen = sizeof(uint32_t) + sizeof(struct ip);
+        if ((int)pcaprec_hdr.incl_len < hlen)
+            continue;
+        iphdr = (struct ip *)(leg->buf + sizeof(uint32_t));
+        if (iphdr->ip_hl < 5)
+            continue;
+        hlen = sizeof(uint32_t) + iphdr->ip_hl * 4 + sizeof(struct udphdr);
+        if ((int)pcaprec_hdr.incl_len < hlen)
+            continue;
+        leg->data = leg->buf + hlen;
+        leg->len = pcaprec_hdr.incl_len - hlen;
+        return 1;
+    }
+}
+
+/* Decode G.711 packet and find its position in the output */
+static int
+leg_decode(struct ea_leg *leg, double t0)
+{
+    rtp_hdr_t *rhp;
+    rtp_hdr_ext_t *ext;
+    int hlen, plen;
+    int64_t apos, pos;
+    uint32_t ts;
+
+    if (leg->len < (int)sizeof(*rhp))
+        return -1;
+    rhp = (rtp_hdr_t *)leg->data;
+    if (rhp->version != 2)
+        return -1;
+    hlen = RTP_HDR_LEN(rhp);
+    if (rhp->x != 0) {
+        if (leg->len < hlen + (int)sizeof(*ext))
+            return -1;
+        ext = (rtp_hdr_ext_t *)(leg->data + hlen);
+        hlen += sizeof(*ext) + ntohs(ext->length) * sizeof(ext->extension[0]);
+    }
+    plen = leg->len - hlen;
+    if (rhp->p != 0 && plen > 0)
+        plen -= leg->data[leg->len - 1];
+    if (plen <= 0 || plen > EA_MAXPKT)
+        return -1;
+
+    switch (rhp->pt) {
+    case RTP_PCMU:
+        ULAW2SL(leg->samples, leg->data + hlen, plen);
+        break;
+
+    case RTP_PCMA:
+        ALAW2SL(leg->samples, leg->data + hlen, plen);
+        break;
+
+    default:
+        return -1;
+    }
+    leg->nsamples = plen;
+
+    apos = (leg->rtime - t0) * EA_RATE;
+    ts = ntohl(rhp->ts);
+    if (leg->anchored != 0) {
+        pos = leg->base_pos + (int32_t)(ts - leg->base_ts);
+        if (ntohl(rhp->ssrc) != leg->ssrc || pos - apos > EA_RESYNC ||
+          apos - pos > EA_RESYNC)
+            leg->anchored = 0;
+    }
+    if (leg->anchored == 0) {
+        leg->anchored = 1;
+        leg->ssrc = ntohl(rhp->ssrc);
+        leg->base_ts = ts;
+        leg->base_pos = pos = apos;
+    }
+    leg->pos = pos;
+    return 0;
+}
+
+/* Get next packet that can be decoded */
+static void
+leg_next(struct ea_leg *leg, double t0)
+{
+
+    leg->have = 0;
+    if (leg->f == NULL)
+        return;
+    for (;;) {
+        if (leg->loaded == 0) {
+            switch (leg_read(leg)) {
+            case -1:
+                warnx("%s: truncated or corrupt recording", leg->path);
+                /* Fall through */
+            case 0:
+                return;
+            }
+        }
+        leg->loaded = 0;
+        if (leg_decode(leg, t0) == 0) {
+            leg->have = 1;
+            return;
+        }
+    }
+}
+
+/* Fill the block starting at bpos with samples of the leg */
+static void
+leg_fill(struct ea_leg *leg, int16_t *block, int64_t bpos, double t0)
+{
+    int64_t i, s, e;
+
+    memset(block, 0, EA_BLOCK * sizeof(block[0]));
+    while (leg->have != 0 && leg->pos < bpos + EA_BLOCK) {
+        s = (leg->pos > bpos) ? leg->pos : bpos;
+        e = leg->pos + leg->nsamples;
+        if (e > bpos + EA_BLOCK)
+            e = bpos + EA_BLOCK;
+        for (i = s; i < e; i++)
+            block[i - bpos] = leg->samples[i - leg->pos];
+        /* The rest of the packet goes into the next block */
+        if (leg->pos + leg->nsamples > bpos + EA_BLOCK)
+            break;
+        leg_next(leg, t0);
+    }
+}
+
+static void
+wav_hdr_init(struct wav_hdr *hdr, uint32_t data_len)
+{
+
+    memcpy(hdr->riff, "RIFF", 4);
+    hdr->riff_len = HOST_2_LE32(data_len + sizeof(*hdr) - 8);
+    memcpy(hdr->wave, "WAVE", 4);
+    memcpy(hdr->fmt, "fmt ", 4);
+    hdr->fmt_len = HOST_2_LE32(16);
+    hdr->format = HOST_2_LE16(1);
+    hdr->nchannels = HOST_2_LE16(2);
+    hdr->rate = HOST_2_LE32(EA_RATE);
+    hdr->byte_rate = HOST_2_LE32(EA_RATE * 2 * sizeof(int16_t));
+    hdr->block_align = HOST_2_LE16(2 * sizeof(int16_t));
+    hdr->bits = HOST_2_LE16(16);
+    memcpy(hdr->data, "data", 4);
+    hdr->data_len = HOST_2_LE32(data_len);
+}
+
+static int
+convert(const char *base)
+{
+    struct ea_leg *legs;
+    struct wav_hdr wav_hdr;
+    int16_t block[2][EA_BLOCK], out[EA_BLOCK * 2];
+    char opath[PATH_MAX + 1];
+    const char *cp;
+    FILE *of;
+    double t0;
+    int64_t bpos;
+    uint32_t data_len;
+    int i, j, rval;
+
+    rval = -1;
+    of = NULL;
+    legs = calloc(2, sizeof(*legs));
+    if (legs == NULL) {
+        warn("can't allocate memory");
+        return -1;
+    }
+    for (i = 0; i < 2; i++) {
+        snprintf(legs[i].path, sizeof(legs[i].path), "%s.%c.rtp", base,
+          (i == 0) ? 'o' : 'a');
+        if (leg_open(&legs[i]) != 0)
+            goto done;
+    }
+    if (legs[0].f == NULL && legs[1].f == NULL) {
+        warnx("%s: no recordings found", base);
+        goto done;
+    }
+
+    if (outdir == NULL) {
+        i = snprintf(opath, sizeof(opath), "%s.wav", base);
+    } else {
+        cp = strrchr(base, '/');
+        i = snprintf(opath, sizeof(opath), "%s/%s.wav", outdir,
+          (cp == NULL) ? base : cp + 1);
+    }
+    if (i >= (int)sizeof(opath)) {
+        warnx("%s: output file name is too long", base);
+        goto done;
+    }
+    of = fopen(opath, "w");
+    if (of == NULL) {
+        warn("can't open %s for writing", opath);
+        goto done;
+    }
+    wav_hdr_init(&wav_hdr, 0);
+    if (fwrite(&wav_hdr, sizeof(wav_hdr), 1, of) != 1)
+        goto werr;
+
+    /* Output starts with the earliest packet of either leg */
+    t0 = -1;
+    for (i = 0; i < 2; i++) {
+        if (legs[i].f == NULL)
+            continue;
+        if (leg_read(&legs[i]) != 1)
+            continue;
+        legs[i].loaded = 1;
+        if (t0 == -1 || legs[i].rtime < t0)
+            t0 = legs[i].rtime;
+    }
+    for (i = 0; i < 2; i++)
+        leg_next(&legs[i], t0);
+
+    data_len = 0;
+    for (bpos = 0; legs[0].have != 0 || legs[1].have != 0; bpos += EA_BLOCK) {
+        for (i = 0; i < 2; i++)
+            leg_fill(&legs[i], block[i], bpos, t0);
+        for (j = 0; j < EA_BLOCK; j++) {
+            out[j * 2] = HOST_2_LE16(block[0][j]);
+            out[j * 2 + 1] = HOST_2_LE16(block[1][j]);
+        }
+        if (fwrite(out, sizeof(out), 1, of) != 1)
+            goto werr;
+        data_len += sizeof(out);
+    }
+
+    wav_hdr_init(&wav_hdr, data_len);
+    if (fseek(of, 0, SEEK_SET) == -1 ||
+      fwrite(&wav_hdr, sizeof(wav_hdr), 1, of) != 1 || fflush(of) != 0)
+        goto werr;
+    rval = 0;
+    goto done;
+
+werr:
+    warn("can't write to %s", opath);
+done:
+    if (of != NULL)
+        fclose(of);
+    for (i = 0; i < 2; i++)
+        if (legs[i].f != NULL)
+            fclose(legs[i].f);
+    free(legs);
+    return rval;
+}
+
+static void *
+worker(void *arg)
+{
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&jobs_mutex);
+        i = nextjob++;
+        pthread_mutex_unlock(&jobs_mutex);
+        if (i >= njobs)
+            break;
+        if (convert(jobs[i]) != 0) {
+            pthread_mutex_lock(&jobs_mutex);
+            nfailed++;
+            pthread_mutex_unlock(&jobs_mutex);
+        }
+    }
+    return NULL;
+}
+
+static void
+add_job(const char *base, int blen)
+{
+
+    if (njobs == jobs_size) {
+        jobs_size = (jobs_size == 0) ? 64 : jobs_size * 2;
+        jobs = realloc(jobs, jobs_size * sizeof(jobs[0]));
+        if (jobs == NULL)
+            err(1, "can't allocate memory");
+    }
+    jobs[njobs] = malloc(blen + 1);
+    if (jobs[njobs] == NULL)
+        err(1, "can't allocate memory");
+    memcpy(jobs[njobs], base, blen);
+    jobs[njobs][blen] = '\0';
+    njobs++;
+}
+
+/* Length of the recording name without the .o.rtp/.a.rtp suffix */
+static int
+base_len(const char *path)
+{
+    int len;
+
+    len = strlen(path);
+    if (len > 6 && (strcmp(path + len - 6, ".o.rtp") == 0 ||
+      strcmp(path + len - 6, ".a.rtp") == 0))
+        return len - 6;
+    return -1;
+}
+
+static void
+add_dir(const char *dir)
+{
+    DIR *dp;
+    struct dirent *dep;
+    struct stat sb;
+    char path[PATH_MAX + 1];
+    int len;
+
+    dp = opendir(dir);
+    if (dp == NULL)
+        err(1, "can't open directory %s", dir);
+    while ((dep = readdir(dp)) != NULL) {
+        if (snprintf(path, sizeof(path), "%s/%s", dir, dep->d_name) >=
+          (int)sizeof(path))
+            continue;
+        len = base_len(path);
+        if (len == -1)
+            continue;
+        /* Only take callee's recording if there is no caller's one */
+        if (path[len + 1] == 'a') {
+            path[len + 1] = 'o';
+            if (stat(path, &sb) == 0)
+                continue;
+        }
+        add_job(path, len);
+    }
+    closedir(dp);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t *threads;
+    struct stat sb;
+    long nthreads;
+    int i, ch, len;
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((ch = getopt(argc, argv, "j:d:")) != -1)
+        switch (ch) {
+        case 'j':
+            nthreads = atoi(optarg);
+            if (nthreads <= 0)
+                errx(1, "%s: invalid number of jobs", optarg);
+            break;
+
+        case 'd':
+            outdir = optarg;
+            break;
+
+        case '?':
+        default:
+            usage();
+        }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1)
+        usage();
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    for (i = 0; i < argc; i++) {
+        if (stat(argv[i], &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            add_dir(argv[i]);
+            continue;
+        }
+        len = base_len(argv[i]);
+        add_job(argv[i], (len == -1) ? (int)strlen(argv[i]) : len);
+    }
+
+    if (nthreads > njobs)
+        nthreads = njobs;
+    threads = malloc(nthreads * sizeof(threads[0]));
+    if (threads == NULL)
+        err(1, "can't allocate memory");
+    for (i = 0; i < nthreads; i++)
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+            errx(1, "can't create thread");
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    return (nfailed == 0) ? 0 : 1;
+}
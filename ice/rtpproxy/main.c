@@ -55,12 +55,20 @@
 #include <unistd.h>
 
 #include "rtp.h"
+#include "rtp_codec.h"
+#include "rtp_dtmf.h"
+#include "rtp_g711.h"
+#include "rtp_mixer.h"
+#include "rtp_prompt.h"
 #include "rtp_resizer.h"
 #include "rtp_server.h"
 #include "rtpp_defines.h"
 #include "rtpp_command.h"
 #include "rtpp_command_async.h"
+#include "rtpp_fork.h"
 #include "rtpp_log.h"
+#include "rtpp_preroll.h"
+#include "rtpp_rcache.h"
 #include "rtpp_record.h"
 #include "rtpp_session.h"
 #include "rtpp_network.h"
@@ -79,10 +87,11 @@ static void
 usage(void)
 {
 
-    fprintf(stderr, "usage: rtpproxy [-2fvFiPa] [-l addr1[/addr2]] "
+    fprintf(stderr, "usage: rtpproxy [-2fvFiPNJWa] [-l addr1[/addr2]] "
       "[-6 addr1[/addr2]] [-s path]\n\t[-t tos] [-r rdir [-S sdir]] [-T ttl] "
       "[-L nfiles] [-m port_min]\n\t[-M port_max] [-u uname[:gname]] "
-      "[-n timeout_socket] [-d log_level[:log_facility]]\n");
+      "[-n timeout_socket] [-d log_level[:log_facility]]\n"
+      "\t[-C prompt_dir] [-B preroll] [-w cmd_workers] [-k tap_dir]\n");
     exit(1);
 }
 
@@ -129,11 +138,12 @@ init_config(struct cfg *cf, int argc, char **argv)
     pthread_mutex_init(&cf->glock, NULL);
     pthread_mutex_init(&cf->sessinfo.lock, NULL);
     pthread_mutex_init(&cf->bindaddr_lock, NULL);
+    pthread_mutex_init(&cf->port_lock, NULL);
 
     if (getrlimit(RLIMIT_NOFILE, &(cf->stable.nofile_limit)) != 0)
 	err(1, "getrlimit");
 
-    while ((ch = getopt(argc, argv, "vf2Rl:6:s:S:t:r:p:T:L:m:M:u:Fin:Pad:A:")) != -1)
+    while ((ch = getopt(argc, argv, "vf2Rl:6:s:S:t:r:p:T:L:m:M:u:Fin:PNJWad:A:C:B:w:k:")) != -1)
 	switch (ch) {
         case 'A':
             cf->stable.advertised = strdup(optarg);
@@ -283,10 +293,42 @@ init_config(struct cfg *cf, int argc, char **argv)
 	    cf->stable.record_pcap = 1;
 	    break;
 
+	case 'N':
+	    cf->stable.record_pcapng = 1;
+	    break;
+
+	case 'J':
+	    cf->stable.record_mux = 1;
+	    break;
+
+	case 'W':
+	    cf->stable.record_wav = 1;
+	    break;
+
 	case 'a':
 	    cf->stable.record_all = 1;
 	    break;
 
+	case 'B':
+	    cf->stable.preroll = atoi(optarg);
+	    if (cf->stable.preroll <= 0)
+		errx(1, "%s: invalid pre-roll time", optarg);
+	    break;
+
+	case 'w':
+	    cf->stable.cmd_workers = atoi(optarg);
+	    if (cf->stable.cmd_workers <= 0 || cf->stable.cmd_workers > 256)
+		errx(1, "%s: invalid number of command workers", optarg);
+	    break;
+
+	case 'C':
+	    cf->stable.prompt_dir = optarg;
+	    break;
+
+	case 'k':
+	    cf->stable.tap_dir = optarg;
+	    break;
+
 	case 'd':
 	    cp = strchr(optarg, ':');
 	    if (cp != NULL) {
@@ -449,45 +491,98 @@ init_controlfd(struct cfg *cf)
     return controlfd;
 }
 
+/*
+ * Send the packet produced by the player to every leg it's playing to.
+ * The payload is shared, each leg gets its own copy of the header so
+ * that it can be rewritten to stay continuous with the leg's stream.
+ */
 static void
-process_rtp_servers(struct cfg *cf, double dtime)
+send_server_packet(struct cfg *cf, struct rtp_server *rp, int len,
+  double dtime)
 {
-    int j, k, sidx, len, skipfd;
+    struct rtp_server_sub *sub;
     struct rtpp_session *sp;
+    struct msghdr msg;
+    struct iovec iov[2];
+    rtp_hdr_t hdr;
+    int k;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = rp->buf + sizeof(hdr);
+    iov[1].iov_len = len - sizeof(hdr);
+
+    for (sub = rp->subs; sub != NULL; sub = sub->next) {
+	sp = sub->sp;
+	if (sp->addr[sub->sidx] == NULL)
+	    continue;
+	memcpy(&hdr, rp->rtp, sizeof(hdr));
+	hdr.pt = sub->pt;
+	rtp_normalizer_apply(&sp->normalizers[sub->sidx], &hdr,
+	  RTPN_SRC_PLAYER, rp->clock_rate, dtime);
+	msg.msg_name = sp->addr[sub->sidx];
+	msg.msg_namelen = SA_LEN(sp->addr[sub->sidx]);
+	for (k = (cf->stable.dmode && len < LBR_THRS) ? 2 : 1; k > 0; k--)
+	    sendmsg(sp->fds[sub->sidx], &msg, 0);
+    }
+}
 
-    skipfd = 0;
-    for (j = 0; j < cf->rtp_nsessions; j++) {
-	sp = cf->rtp_servers[j];
-	if (sp == NULL) {
-	    skipfd++;
+static void
+process_rtp_servers(struct cfg *cf, double dtime)
+{
+    int len;
+    struct rtp_server *rp;
+
+    while (cf->rtp_nservers > 0 && cf->rtp_servers[0]->ntime <= dtime) {
+	rp = cf->rtp_servers[0];
+	if (!rp->bcast && rp->subs->sp->addr[rp->subs->sidx] == NULL) {
+	    /* Hold off until we know where to send packets */
+	    rp->ntime = dtime + RTPS_TICKS_MIN / 1000.0;
+	    reschedule_server(cf, rp);
 	    continue;
 	}
-	if (skipfd > 0) {
-	    cf->rtp_servers[j - skipfd] = cf->rtp_servers[j];
-	    sp->sridx = j - skipfd;
+	len = rtp_server_get(rp, dtime);
+	if (len == RTPS_EOF || len == RTPS_ERROR) {
+	    /* The player is gone along with the last leg */
+	    while (rp->nsubs > 1)
+		rtp_server_unsubscribe(cf, rp, rp->subs->sp, rp->subs->sidx);
+	    rtp_server_unsubscribe(cf, rp, rp->subs->sp, rp->subs->sidx);
+	    continue;
 	}
-	for (sidx = 0; sidx < 2; sidx++) {
-	    if (sp->rtps[sidx] == NULL || sp->addr[sidx] == NULL)
-		continue;
-	    while ((len = rtp_server_get(sp->rtps[sidx], dtime)) != RTPS_LATER) {
-		if (len == RTPS_EOF) {
-		    rtp_server_free(sp->rtps[sidx]);
-		    sp->rtps[sidx] = NULL;
-		    if (sp->rtps[0] == NULL && sp->rtps[1] == NULL) {
-			assert(cf->rtp_servers[sp->sridx] == sp);
-			cf->rtp_servers[sp->sridx] = NULL;
-			sp->sridx = -1;
-		    }
-		    break;
-		}
+	if (len != RTPS_LATER)
+	    send_server_packet(cf, rp, len, dtime);
+	reschedule_server(cf, rp);
+    }
+}
+
+static void
+process_rtp_mixers(struct cfg *cf, double dtime)
+{
+    int k, len;
+    struct rtp_mixer *mp;
+    struct rtp_mixer_leg *lp;
+    struct rtpp_session *sp;
+
+    for (mp = cf->rtp_mixers; mp != NULL; mp = mp->next) {
+	while (rtp_mixer_mix(mp, dtime) != 0) {
+	    for (lp = mp->legs; lp != NULL; lp = lp->next) {
+		len = rtp_mixer_get(lp);
+		sp = lp->sp;
+		/* Player takes precedence over the conference */
+		if (sp->addr[lp->idx] == NULL || sp->rtps[lp->idx] != NULL)
+		    continue;
+		rtp_normalizer_apply(&sp->normalizers[lp->idx], lp->rtp,
+		  RTPN_SRC_MIXER, 8000, dtime);
 		for (k = (cf->stable.dmode && len < LBR_THRS) ? 2 : 1; k > 0; k--) {
-		    sendto(sp->fds[sidx], sp->rtps[sidx]->buf, len, 0,
-		      sp->addr[sidx], SA_LEN(sp->addr[sidx]));
+		    sendto(sp->fds[lp->idx], lp->buf, len, 0,
+		      sp->addr[lp->idx], SA_LEN(sp->addr[lp->idx]));
 		}
 	    }
 	}
     }
-    cf->rtp_nsessions -= skipfd;
 }
 
 static void
@@ -496,6 +591,7 @@ rxmit_packets(struct cfg *cf, struct rtpp_session *sp, int ridx,
 {
     int ndrain, i, port;
     struct rtp_packet *packet = NULL;
+    struct rtp_dtmf_event dtmf_ev;
 
     /* Repeat since we may have several packets queued on the same socket */
     for (ndrain = 0; ndrain < 1; ndrain++) {
@@ -617,8 +713,21 @@ rxmit_packets(struct cfg *cf, struct rtpp_session *sp, int ridx,
 	    }
 	}
 
-	if (sp->resizers[ridx].output_nsamples > 0)
-	    rtp_resizer_enqueue(&sp->resizers[ridx], &packet);
+	if (sp->dtmf[ridx] != NULL &&
+	  rtp_dtmf_is_event(sp->rtpmap[ridx], packet->data.header.pt) &&
+	  rtp_packet_parse(packet, sp->rtpmap[ridx]) == RTP_PARSER_OK &&
+	  rtp_dtmf_input(sp->dtmf[ridx], packet, &dtmf_ev) != 0) {
+	    rtpp_log_write(RTPP_LOG_INFO, sp->log, "DTMF digit %c (%d ms) "
+	      "from %s", dtmf_ev.digit, dtmf_ev.duration,
+	      (ridx == 0) ? "callee" : "caller");
+	    rtpp_notify_schedule_dtmf(cf, sp, ridx, dtmf_ev.digit,
+	      dtmf_ev.duration);
+	}
+	if (sp->rtpm[ridx] != NULL &&
+	  rtp_packet_parse(packet, sp->rtpmap[ridx]) == RTP_PARSER_OK)
+	    rtp_mixer_put(sp->rtpm[ridx], packet);
+	if (is_rtp_resizer_enabled(sp->resizers[ridx]))
+	    rtp_resizer_enqueue(&sp->resizers[ridx], &packet, sp->rtpmap[ridx]);
 	if (packet != NULL)
 	    send_packet(cf, sp, ridx, packet);
     }
@@ -632,28 +741,50 @@ send_packet(struct cfg *cf, struct rtpp_session *sp, int ridx,
   struct rtp_packet *packet)
 {
     int i, sidx;
+    const struct rtp_codec_ent *cent;
 
     GET_RTP(sp)->ttl[ridx] = cf->stable.max_ttl;
 
     /* Select socket for sending packet out. */
     sidx = (ridx == 0) ? 1 : 0;
 
+    /* Record packet as received, before any transcoding is applied. */
+    if (sp->rrcs[ridx] != NULL && GET_RTP(sp)->rtps[ridx] == NULL) {
+	rwrite(sp, sp->rrcs[ridx], packet);
+    } else if (cf->stable.preroll > 0 && GET_RTP(sp)->rtps[ridx] == NULL &&
+      (sp->rtcp != NULL || cf->stable.rrtcp != 0)) {
+	if (sp->preroll[ridx] == NULL)
+	    sp->preroll[ridx] = rtpp_preroll_new(cf->stable.preroll,
+	      sp->rtcp == NULL);
+	if (sp->preroll[ridx] != NULL)
+	    rtpp_preroll_put(sp->preroll[ridx], packet);
+    }
+    if (sp->forks[ridx] != NULL && GET_RTP(sp)->rtps[ridx] == NULL)
+	rtpp_fork_send(sp->forks[ridx], packet);
+
     /*
      * Check that we have some address to which packet is to be
      * sent out, drop otherwise.
      */
-    if (sp->addr[sidx] == NULL || GET_RTP(sp)->rtps[sidx] != NULL) {
+    if (sp->addr[sidx] == NULL || GET_RTP(sp)->rtps[sidx] != NULL ||
+      GET_RTP(sp)->rtpm[sidx] != NULL) {
 	sp->pcount[3]++;
     } else {
 	sp->pcount[2]++;
+	if (sp->xcode[sidx] != NULL &&
+	  rtp_packet_parse(packet, sp->rtpmap[ridx]) == RTP_PARSER_OK)
+	    rtp_g711_transcode(packet, sp->xcode[sidx]);
+	if (sp->rtcp != NULL && packet->size >= sizeof(packet->data.header)) {
+	    cent = rtp_codec_lookup(sp->rtpmap[ridx], packet->data.header.pt);
+	    rtp_normalizer_apply(&sp->normalizers[sidx], &packet->data.header,
+	      RTPN_SRC_RELAY, (cent != NULL) ? cent->clock_rate : 8000,
+	      packet->rtime);
+	}
 	for (i = (cf->stable.dmode && packet->size < LBR_THRS) ? 2 : 1; i > 0; i--) {
 	    sendto(sp->fds[sidx], packet->data.buf, packet->size, 0, sp->addr[sidx],
 	      SA_LEN(sp->addr[sidx]));
 	}
     }
-
-    if (sp->rrcs[ridx] != NULL && GET_RTP(sp)->rtps[ridx] == NULL)
-	rwrite(sp, sp->rrcs[ridx], packet);
 }
 
 static void
@@ -708,7 +839,7 @@ process_rtp(struct cfg *cf, double dtime, int alarm_tick)
 	if (sp->complete != 0) {
 	    if ((cf->sessinfo.pfds[readyfd].revents & POLLIN) != 0)
 		rxmit_packets(cf, sp, ridx, dtime);
-	    if (sp->resizers[ridx].output_nsamples > 0) {
+	    if (is_rtp_resizer_enabled(sp->resizers[ridx])) {
 		while ((packet = rtp_resizer_get(&sp->resizers[ridx], dtime)) != NULL) {
 		    send_packet(cf, sp, ridx, packet);
 		    rtp_packet_free(packet);
@@ -724,9 +855,9 @@ process_rtp(struct cfg *cf, double dtime, int alarm_tick)
 int
 main(int argc, char **argv)
 {
-    int i, len, timeout, controlfd, alarm_tick;
-    double sptime, eptime, last_tick_time;
-    unsigned long delay;
+    int i, len, timeout, ptimeout, controlfd, alarm_tick;
+    double sptime, eptime, sdtime, last_tick_time;
+    unsigned long delay, sdelay;
     struct cfg cf;
     char buf[256];
 
@@ -735,6 +866,7 @@ main(int argc, char **argv)
     init_config(&cf, argc, argv);
 
     seedrandom();
+    rtp_g711_init();
 
     init_hash_table(&cf.stable);
 #ifdef DEBUG_BUILD
@@ -754,6 +886,14 @@ main(int argc, char **argv)
     atexit(ehandler);
     rtpp_log_write(RTPP_LOG_INFO, cf.stable.glog, "rtpproxy started, pid %d", getpid());
 
+    if (cf.stable.prompt_dir != NULL)
+	rtp_prompt_preload(cf.stable.glog, cf.stable.prompt_dir);
+
+    if (rtpp_record_init(glog) != 0) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, glog, "can't start recording thread");
+	exit(1);
+    }
+
     if (cf.timeout_socket != NULL) {
 	cf.timeout_handler = rtpp_notify_init(glog, cf.timeout_socket);
 	if (cf.timeout_handler == NULL) {
@@ -792,18 +932,31 @@ main(int argc, char **argv)
     }
 
     cf.stable.controlfd = controlfd;
+    if (cf.stable.umode != 0) {
+	cf.stable.rcache = rtpp_rcache_new();
+	if (cf.stable.rcache == NULL)
+	    err(1, "can't allocate memory");
+    }
 
     cf.sessinfo.sessions[0] = NULL;
     cf.sessinfo.nsessions = 0;
-    cf.rtp_nsessions = 0;
+    cf.rtp_nservers = 0;
 
     rtpp_command_async_init(&cf);
 
     sptime = 0;
     eptime = getdtime();
     last_tick_time = 0;
+    sdtime = 0;
     timeout = 1000 / POLL_RATE;
     for (;;) {
+	/*
+	 * Don't sleep or wait in poll(2) past the time when the next
+	 * player packet is due.
+	 */
+	sdelay = 1000000 / POLL_RATE;
+	if (sdtime > 0)
+	    sdelay = (sdtime > eptime) ? MIN((sdtime - eptime) * 1000000.0, sdelay) : 0;
 	delay = (eptime - sptime) * 1000000.0;
 	if (delay <= 0) {
             /* Time went backwards, handle that */
@@ -811,13 +964,17 @@ main(int argc, char **argv)
 	    last_tick_time = 0;
 	} else 	if (delay < (1000000 / POLL_RATE)) {
 	    sptime += 1.0 / (double)POLL_RATE;
-	    usleep((1000000 / POLL_RATE) - delay);
+	    delay = MIN((1000000 / POLL_RATE) - delay, sdelay);
+	    if (delay > 0)
+		usleep(delay);
+	    sdelay -= delay;
 	} else {
 	    sptime = eptime;
 	}
+	ptimeout = (sdtime > 0) ? MIN(timeout, (sdelay + 999) / 1000) : timeout;
         pthread_mutex_lock(&cf.sessinfo.lock);
         if (cf.sessinfo.nsessions > 0) {
-	    i = poll(cf.sessinfo.pfds, cf.sessinfo.nsessions, timeout);
+	    i = poll(cf.sessinfo.pfds, cf.sessinfo.nsessions, ptimeout);
             pthread_mutex_unlock(&cf.sessinfo.lock);
 	    if (i < 0 && errno == EINTR)
 	        continue;
@@ -834,9 +991,14 @@ main(int argc, char **argv)
         }
         pthread_mutex_lock(&cf.glock);
 	process_rtp(&cf, eptime, alarm_tick);
-	if (cf.rtp_nsessions > 0) {
+	if (cf.rtp_nservers > 0) {
 	    process_rtp_servers(&cf, eptime);
 	}
+	/* Wake up in time for the next player packet */
+	sdtime = (cf.rtp_nservers > 0) ? cf.rtp_servers[0]->ntime : 0;
+	if (cf.rtp_mixers != NULL) {
+	    process_rtp_mixers(&cf, eptime);
+	}
         pthread_mutex_unlock(&cf.glock);
     }
 
@@ -53,6 +53,7 @@ rm -rf $RPM_BUILD_ROOT
 %{_mandir}/man8/*
 %attr(755,root,root) %{_bindir}/rtpproxy
 %attr(755,root,root) %{_bindir}/makeann
+%attr(755,root,root) %{_bindir}/extractaudio
 %config %attr(755,root,root) /etc/rc.d/init.d/*
 
 %changelog
@@ -32,6 +32,7 @@
 #include <assert.h>
 
 #include "rtp.h"
+#include "rtp_codec.h"
 #include "rtpp_network.h"
 
 /* Linked list of free packets */
@@ -74,10 +75,11 @@ g723_samples(const unsigned char *buf, int maxlen)
 }
 
 static int 
-rtp_calc_samples(int codec_id, size_t nbytes, const unsigned char *data)
+rtp_calc_samples(const struct rtp_codec *codec, int clock_rate, size_t nbytes,
+  const unsigned char *data)
 {
 
-    switch (codec_id) {
+    switch (codec->id) {
 	case RTP_PCMU:
 	case RTP_PCMA:
 	    return nbytes;
@@ -92,7 +94,13 @@ rtp_calc_samples(int codec_id, size_t nbytes, const unsigned char *data)
 	    return g723_samples(data, nbytes);
 
 	case RTP_G722:
-	    return nbytes * 2; 
+	    /*
+	     * 64 kbps, the RTP clock is 8 kHz as per RFC 3551, although
+	     * some implementations use the actual 16 kHz sampling rate.
+	     */
+	    if (clock_rate < 8000)
+		return RTP_NSAMPLES_UNKNOWN;
+	    return nbytes * (clock_rate / 8000);
 
 	default:
 	    return RTP_NSAMPLES_UNKNOWN;
@@ -169,8 +177,11 @@ rtp_packet_chunk_find_g723(struct rtp_packet *pkt, struct rtp_packet_chunk *ret,
 static void
 rtp_packet_chunk_find_g722(struct rtp_packet *pkt, struct rtp_packet_chunk *ret, int min_nsamples)
 {
-    ret->nsamples = min_nsamples;
-    ret->bytes = min_nsamples / 2;
+    int nsamples_per_byte;
+
+    nsamples_per_byte = pkt->clock_rate / 8000;
+    ret->bytes = min_nsamples / nsamples_per_byte;
+    ret->nsamples = ret->bytes * nsamples_per_byte;
 }
 
 
@@ -187,7 +198,7 @@ rtp_packet_first_chunk_find(struct rtp_packet *pkt, struct rtp_packet_chunk *ret
     assert(pkt->nsamples > min_nsamples);
     ret->whole_packet_matched = 0;
 
-    switch (pkt->data.header.pt) {
+    switch (pkt->codec->id) {
     case RTP_PCMU:
     case RTP_PCMA:
 	rtp_packet_chunk_find_g711(pkt, ret, min_nsamples);
@@ -252,10 +263,11 @@ rtp_packet_parse_errstr(rtp_parser_err_t ecode)
 }
 
 rtp_parser_err_t
-rtp_packet_parse(struct rtp_packet *pkt)
+rtp_packet_parse(struct rtp_packet *pkt, const struct rtp_codec_map *map)
 {
     int padding_size;
     rtp_hdr_ext_t *hdr_ext_ptr;
+    const struct rtp_codec_ent *cent;
 
     padding_size = 0;
 
@@ -263,6 +275,8 @@ rtp_packet_parse(struct rtp_packet *pkt)
     pkt->data_offset = 0;
     pkt->appendable = 1;
     pkt->nsamples = RTP_NSAMPLES_UNKNOWN;
+    pkt->codec = NULL;
+    pkt->clock_rate = 0;
 
     if (pkt->size < sizeof(pkt->data.header))
         return RTP_PARSER_PTOOSHRT;
@@ -298,16 +312,19 @@ rtp_packet_parse(struct rtp_packet *pkt)
     pkt->ts = ntohl(pkt->data.header.ts);
     pkt->seq = ntohs(pkt->data.header.seq);
 
-    if (pkt->data_size == 0)
+    cent = rtp_codec_lookup(map, pkt->data.header.pt);
+    if (cent == NULL || pkt->data_size == 0)
         return RTP_PARSER_OK;
+    pkt->codec = cent->codec;
+    pkt->clock_rate = cent->clock_rate;
 
-    pkt->nsamples = rtp_calc_samples(pkt->data.header.pt, pkt->data_size,
-      &pkt->data.buf[pkt->data_offset]);
+    pkt->nsamples = rtp_calc_samples(pkt->codec, pkt->clock_rate,
+      pkt->data_size, &pkt->data.buf[pkt->data_offset]);
     /* 
      * G.729 comfort noise frame as the last frame causes 
      * packet to be non-appendable
      */
-    if (pkt->data.header.pt == RTP_G729 && (pkt->data_size % 10) != 0)
+    if (pkt->codec->id == RTP_G729 && (pkt->data_size % 10) != 0)
         pkt->appendable = 0;
     return RTP_PARSER_OK;
 }
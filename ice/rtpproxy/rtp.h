@@ -49,6 +49,9 @@ typedef enum {
 
 #define RTP_NSAMPLES_UNKNOWN  (-1)
 
+struct rtp_codec;
+struct rtp_codec_map;
+
 /*
  * RTP data header
  */
@@ -90,6 +93,8 @@ struct rtp_packet {
     size_t      data_size;
     int         data_offset;
     int         nsamples;
+    const struct rtp_codec *codec;
+    int         clock_rate;
     uint32_t    ts;
     uint16_t    seq;
     int         appendable;
@@ -130,7 +135,7 @@ typedef enum {
 #define	RTP_HDR_LEN(rhp)	(sizeof(*(rhp)) + ((rhp)->cc * sizeof((rhp)->csrc[0])))
 
 const char *rtp_packet_parse_errstr(rtp_parser_err_t);
-rtp_parser_err_t rtp_packet_parse(struct rtp_packet *);
+rtp_parser_err_t rtp_packet_parse(struct rtp_packet *, const struct rtp_codec_map *);
 struct rtp_packet *rtp_recv(int);
 
 struct rtp_packet *rtp_packet_alloc();
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "rtp.h"
+#include "rtp_codec.h"
+
+static const struct rtp_codec rtp_codecs[] = {
+    {RTP_PCMU,	"PCMU",			8000},
+    {RTP_GSM,	"GSM",			8000},
+    {RTP_G723,	"G723",			8000},
+    {RTP_PCMA,	"PCMA",			8000},
+    {RTP_G722,	"G722",			8000},
+    {RTP_CN,	"CN",			8000},
+    {RTP_G729,	"G729",			8000},
+    {RTP_TSE,	"telephone-event",	8000},
+    {0,		NULL,			0}
+};
+
+/* Static payload type assignments, see RFC 3551 */
+static const struct rtp_codec_ent rtp_codec_static[128] = {
+    [RTP_PCMU] = {&rtp_codecs[0], 8000},
+    [RTP_GSM]  = {&rtp_codecs[1], 8000},
+    [RTP_G723] = {&rtp_codecs[2], 8000},
+    [RTP_PCMA] = {&rtp_codecs[3], 8000},
+    [RTP_G722] = {&rtp_codecs[4], 8000},
+    [RTP_CN]   = {&rtp_codecs[5], 8000},
+    [RTP_G729] = {&rtp_codecs[6], 8000}
+};
+
+const struct rtp_codec *
+rtp_codec_byname(const char *name, int len)
+{
+    const struct rtp_codec *codec;
+
+    for (codec = rtp_codecs; codec->name != NULL; codec++) {
+	if (strncasecmp(codec->name, name, len) == 0 &&
+	  codec->name[len] == '\0')
+	    return codec;
+    }
+    return NULL;
+}
+
+const struct rtp_codec_ent *
+rtp_codec_lookup(const struct rtp_codec_map *map, int pt)
+{
+
+    if (pt < 0 || pt > 127)
+	return NULL;
+    if (map != NULL && map->ent[pt].codec != NULL)
+	return &map->ent[pt];
+    if (rtp_codec_static[pt].codec != NULL)
+	return &rtp_codec_static[pt];
+    return NULL;
+}
+
+/*
+ * Parse codec list in the form "PT[=NAME/RATE[/CHANNELS]][,...]" as
+ * supplied with the `c' command modifier. The list of bare payload types
+ * is copied into the plist, which should be at least as long as the
+ * input. Encoding names we don't know about are accepted and ignored.
+ * Returns number of list entries parsed or -1 on syntax error, *end is
+ * set to point to the first character after the list.
+ */
+int
+rtp_codec_map_parse(const char *str, char **end, struct rtp_codec_map *map,
+  char *plist)
+{
+    const char *cp, *name;
+    const struct rtp_codec *codec;
+    char *pp;
+    int n, pt, rate;
+
+    memset(map, '\0', sizeof(*map));
+    pp = plist;
+    for (n = 0, cp = str; isdigit(*cp);) {
+	for (pt = 0; isdigit(*cp); cp++) {
+	    pt = (pt * 10) + (*cp - '0');
+	    if (pt > 127)
+		return -1;
+	    *pp++ = *cp;
+	}
+	if (*cp == '=') {
+	    for (name = ++cp; *cp != '/' && *cp != ',' && *cp != '\0'; cp++)
+		continue;
+	    if (*cp != '/' || cp == name || !isdigit(cp[1]))
+		return -1;
+	    codec = rtp_codec_byname(name, cp - name);
+	    rate = strtol(cp + 1, (char **)&cp, 10);
+	    if (rate <= 0)
+		return -1;
+	    /* Number of channels, not used */
+	    if (*cp == '/' && isdigit(cp[1]))
+		strtol(cp + 1, (char **)&cp, 10);
+	    if (codec != NULL) {
+		map->ent[pt].codec = codec;
+		map->ent[pt].clock_rate = rate;
+	    }
+	} else if (rtp_codec_static[pt].codec != NULL) {
+	    map->ent[pt] = rtp_codec_static[pt];
+	}
+	n++;
+	if (*cp != ',')
+	    break;
+	*pp++ = *cp++;
+    }
+    *pp = '\0';
+    *end = (char *)cp;
+    return (n == 0) ? -1 : n;
+}
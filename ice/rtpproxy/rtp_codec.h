@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RTP_CODEC_H_
+#define _RTP_CODEC_H_
+
+#include "rtp.h"
+
+struct rtp_codec {
+    rtp_type_t  id;		/* internal codec id, same as static PT */
+    const char  *name;		/* encoding name as used in SDP rtpmap */
+    int         clock_rate;	/* default RTP clock rate */
+};
+
+/* Binding of the payload type to the codec */
+struct rtp_codec_ent {
+    const struct rtp_codec *codec;
+    int         clock_rate;
+};
+
+/*
+ * Per-stream payload type map, built from the codec list supplied in the
+ * update/lookup command. Payload types not present in the map fall back
+ * to the static assignments.
+ */
+struct rtp_codec_map {
+    struct rtp_codec_ent ent[128];
+};
+
+const struct rtp_codec *rtp_codec_byname(const char *, int);
+const struct rtp_codec_ent *rtp_codec_lookup(const struct rtp_codec_map *, int);
+int rtp_codec_map_parse(const char *, char **, struct rtp_codec_map *, char *);
+
+#endif
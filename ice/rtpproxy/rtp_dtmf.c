@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rtp.h"
+#include "rtp_codec.h"
+#include "rtp_dtmf.h"
+
+/* RFC 4733 telephone-event payload */
+struct rtp_dtmf_pload {
+    uint8_t event;
+#if BYTE_ORDER == BIG_ENDIAN
+    unsigned int e:1;		/* end of event */
+    unsigned int r:1;		/* reserved */
+    unsigned int volume:6;
+#else
+    unsigned int volume:6;
+    unsigned int r:1;
+    unsigned int e:1;
+#endif
+    uint16_t duration;
+} __attribute__((__packed__));
+
+static const char rtp_dtmf_digits[] = "0123456789*#ABCD";
+
+void
+rtp_dtmf_init(struct rtp_dtmf *dp)
+{
+
+    dp->ts = 0;
+    dp->event = -1;
+    dp->duration = 0;
+    dp->reported = 0;
+}
+
+/*
+ * Check whether payload type carries telephone events. Well-known 100
+ * and 101 are assumed unless the payload type is bound to some other
+ * codec, as the list of bare payload types doesn't bind dynamic ones.
+ */
+int
+rtp_dtmf_is_event(const struct rtp_codec_map *map, int pt)
+{
+    const struct rtp_codec_ent *cent;
+
+    cent = rtp_codec_lookup(map, pt);
+    if (cent == NULL)
+	return (pt == RTP_TSE || pt == RTP_TSE_CISCO);
+    return (cent->codec->id == RTP_TSE);
+}
+
+/*
+ * Feed parsed telephone-event packet into the detector. Returns 1 and
+ * fills in *ev when a digit is complete, which happens either when the
+ * first of the redundant end packets arrives or when a new event starts
+ * while the end of the previous one has been lost. Returns 0 otherwise.
+ */
+int
+rtp_dtmf_input(struct rtp_dtmf *dp, struct rtp_packet *pkt,
+  struct rtp_dtmf_event *ev)
+{
+    const struct rtp_dtmf_pload *pl;
+    int clock_rate, rval;
+
+    if (pkt->data_size < sizeof(*pl))
+	return 0;
+    pl = (const struct rtp_dtmf_pload *)&pkt->data.buf[pkt->data_offset];
+    if (pl->event >= sizeof(rtp_dtmf_digits) - 1)
+	return 0;
+    clock_rate = (pkt->clock_rate > 0) ? pkt->clock_rate : 8000;
+
+    rval = 0;
+    if (dp->event == -1 || dp->ts != pkt->ts) {
+	if (dp->event != -1 && dp->reported == 0) {
+	    ev->digit = rtp_dtmf_digits[dp->event];
+	    ev->duration = dp->duration;
+	    rval = 1;
+	}
+	dp->ts = pkt->ts;
+	dp->event = pl->event;
+	dp->reported = 0;
+    }
+    if (dp->reported != 0)
+	return rval;
+
+    dp->duration = (int)((uint64_t)ntohs(pl->duration) * 1000 / clock_rate);
+    if (pl->e != 0 && rval == 0) {
+	ev->digit = rtp_dtmf_digits[dp->event];
+	ev->duration = dp->duration;
+	dp->reported = 1;
+	rval = 1;
+    }
+    return rval;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RTP_DTMF_H_
+#define _RTP_DTMF_H_
+
+#include <stdint.h>
+
+struct rtp_codec_map;
+struct rtp_packet;
+
+/* RFC 4733 telephone-event detector state, one per stream */
+struct rtp_dtmf {
+    /* Timestamp and code of the last event seen, or -1 */
+    uint32_t ts;
+    int event;
+    /* Duration of the last event, in milliseconds */
+    int duration;
+    int reported;
+};
+
+struct rtp_dtmf_event {
+    int digit;
+    int duration;
+};
+
+void rtp_dtmf_init(struct rtp_dtmf *);
+int rtp_dtmf_is_event(const struct rtp_codec_map *, int);
+int rtp_dtmf_input(struct rtp_dtmf *, struct rtp_packet *, struct rtp_dtmf_event *);
+
+#endif
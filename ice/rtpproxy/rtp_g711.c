@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "g711.h"
+#include "rtp.h"
+#include "rtp_codec.h"
+#include "rtp_g711.h"
+
+/* Direct mu-law <-> A-law conversion tables */
+static uint8_t _u2A[256];
+static uint8_t _A2u[256];
+
+void
+rtp_g711_init(void)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+	SL2ALAW(&_u2A[i], &_u2sl[i], 1);
+	SL2ULAW(&_A2u[i], &_A2sl[i], 1);
+    }
+}
+
+/*
+ * Conversion routines below are safe to be used with the same buffer
+ * for the input and output when converting between the laws.
+ */
+void
+g711_ulaw2alaw(uint8_t *alp, const uint8_t *ulp, int nbytes)
+{
+    int i;
+
+    for (i = 0; i < nbytes; i++)
+	alp[i] = _u2A[ulp[i]];
+}
+
+void
+g711_alaw2ulaw(uint8_t *ulp, const uint8_t *alp, int nbytes)
+{
+    int i;
+
+    for (i = 0; i < nbytes; i++)
+	ulp[i] = _A2u[alp[i]];
+}
+
+void
+g711_ulaw2sl(int16_t *slp, const uint8_t *ulp, int nbytes)
+{
+
+    ULAW2SL(slp, ulp, nbytes);
+}
+
+void
+g711_alaw2sl(int16_t *slp, const uint8_t *alp, int nbytes)
+{
+
+    ALAW2SL(slp, alp, nbytes);
+}
+
+void
+g711_sl2ulaw(uint8_t *ulp, const int16_t *slp, int nwords)
+{
+
+    SL2ULAW(ulp, slp, nwords);
+}
+
+void
+g711_sl2alaw(uint8_t *alp, const int16_t *slp, int nwords)
+{
+
+    SL2ALAW(alp, slp, nwords);
+}
+
+/*
+ * Convert payload of the parsed G.711 packet into the encoding of the
+ * target codec in place. Returns 0 if the packet has been converted or
+ * is already in the target encoding, -1 if it can't be converted.
+ */
+int
+rtp_g711_transcode(struct rtp_packet *pkt, const struct rtp_codec *to)
+{
+    uint8_t *pload;
+
+    if (pkt->codec == NULL)
+	return -1;
+    if (pkt->codec == to)
+	return 0;
+
+    pload = &pkt->data.buf[pkt->data_offset];
+    if (pkt->codec->id == RTP_PCMU && to->id == RTP_PCMA) {
+	g711_ulaw2alaw(pload, pload, pkt->data_size);
+    } else if (pkt->codec->id == RTP_PCMA && to->id == RTP_PCMU) {
+	g711_alaw2ulaw(pload, pload, pkt->data_size);
+    } else {
+	return -1;
+    }
+    pkt->data.header.pt = to->id;
+    pkt->codec = to;
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtp.h"
+#include "rtp_codec.h"
+#include "rtp_g711.h"
+#include "rtp_mixer.h"
+#include "rtpp_session.h"
+#include "rtpp_util.h"
+
+static struct rtp_mixer *
+rtp_mixer_new(struct cfg *cf, const char *name)
+{
+    struct rtp_mixer *mp;
+
+    mp = malloc(sizeof(*mp));
+    if (mp == NULL)
+	return NULL;
+    memset(mp, 0, sizeof(*mp));
+    mp->name = strdup(name);
+    if (mp->name == NULL) {
+	free(mp);
+	return NULL;
+    }
+    mp->ntime = getdtime();
+
+    mp->next = cf->rtp_mixers;
+    if (cf->rtp_mixers != NULL)
+	cf->rtp_mixers->prev = mp;
+    cf->rtp_mixers = mp;
+
+    rtpp_log_write(RTPP_LOG_INFO, cf->stable.glog, "new conference %s", name);
+    return mp;
+}
+
+static void
+rtp_mixer_free(struct cfg *cf, struct rtp_mixer *mp)
+{
+
+    rtpp_log_write(RTPP_LOG_INFO, cf->stable.glog, "conference %s is over",
+      mp->name);
+    if (mp->prev != NULL)
+	mp->prev->next = mp->next;
+    else
+	cf->rtp_mixers = mp->next;
+    if (mp->next != NULL)
+	mp->next->prev = mp->prev;
+    free(mp->name);
+    free(mp);
+}
+
+struct rtp_mixer_leg *
+rtp_mixer_join(struct cfg *cf, const char *name, struct rtpp_session *sp,
+  int idx)
+{
+    struct rtp_mixer *mp;
+    struct rtp_mixer_leg *lp;
+
+    for (mp = cf->rtp_mixers; mp != NULL; mp = mp->next)
+	if (strcmp(mp->name, name) == 0)
+	    break;
+
+    lp = malloc(sizeof(*lp));
+    if (lp == NULL)
+	return NULL;
+    memset(lp, 0, sizeof(*lp));
+
+    if (mp == NULL) {
+	mp = rtp_mixer_new(cf, name);
+	if (mp == NULL) {
+	    free(lp);
+	    return NULL;
+	}
+    }
+
+    lp->mixer = mp;
+    lp->sp = sp;
+    lp->idx = idx;
+    lp->codec = rtp_codec_lookup(NULL, RTP_PCMU)->codec;
+
+    lp->rtp = (rtp_hdr_t *)lp->buf;
+    lp->rtp->version = 2;
+    lp->rtp->p = 0;
+    lp->rtp->x = 0;
+    lp->rtp->cc = 0;
+    lp->rtp->m = 1;
+    lp->rtp->pt = lp->codec->id;
+    lp->ssrc = random();
+    lp->pload = lp->buf + RTP_HDR_LEN(lp->rtp);
+
+    lp->next = mp->legs;
+    mp->legs = lp;
+    mp->nlegs++;
+
+    return lp;
+}
+
+void
+rtp_mixer_leave(struct cfg *cf, struct rtp_mixer_leg *lp)
+{
+    struct rtp_mixer *mp;
+    struct rtp_mixer_leg **lpp;
+
+    mp = lp->mixer;
+    for (lpp = &mp->legs; *lpp != lp; lpp = &(*lpp)->next)
+	continue;
+    *lpp = lp->next;
+    mp->nlegs--;
+    free(lp);
+
+    if (mp->nlegs == 0)
+	rtp_mixer_free(cf, mp);
+}
+
+/*
+ * Decode G.711 payload of the parsed packet received from the participant
+ * and append it to the input buffer, dropping the oldest audio if the
+ * buffer is full. Packets in other encodings are ignored.
+ */
+void
+rtp_mixer_put(struct rtp_mixer_leg *lp, struct rtp_packet *pkt)
+{
+    const uint8_t *pload;
+    int nsamples, ndrop;
+
+    if (pkt->codec == NULL ||
+      (pkt->codec->id != RTP_PCMU && pkt->codec->id != RTP_PCMA))
+	return;
+
+    pload = &pkt->data.buf[pkt->data_offset];
+    nsamples = pkt->data_size;
+    if (nsamples > RTPM_MAXSAMPLES) {
+	pload += nsamples - RTPM_MAXSAMPLES;
+	nsamples = RTPM_MAXSAMPLES;
+    }
+    ndrop = lp->ilen + nsamples - RTPM_MAXSAMPLES;
+    if (ndrop > 0) {
+	lp->ilen -= ndrop;
+	memmove(lp->ibuf, lp->ibuf + ndrop, lp->ilen * sizeof(lp->ibuf[0]));
+    }
+
+    if (pkt->codec->id == RTP_PCMU)
+	g711_ulaw2sl(lp->ibuf + lp->ilen, pload, nsamples);
+    else
+	g711_alaw2sl(lp->ibuf + lp->ilen, pload, nsamples);
+    lp->ilen += nsamples;
+    lp->codec = pkt->codec;
+}
+
+/*
+ * Mix next frame of the conference if it's time to. Returns 1 when new
+ * frame is ready to be picked by rtp_mixer_get(), 0 otherwise.
+ */
+int
+rtp_mixer_mix(struct rtp_mixer *mp, double dtime)
+{
+    struct rtp_mixer_leg *lp;
+    int i;
+
+    if (mp->ntime > dtime)
+	return 0;
+    if (dtime - mp->ntime > RTPM_MAXLAG)
+	mp->ntime = dtime;
+    mp->ntime += (double)RTPM_PTIME / 1000.0;
+
+    memset(mp->sum, 0, sizeof(mp->sum));
+    for (lp = mp->legs; lp != NULL; lp = lp->next) {
+	/* Participant that didn't send a full frame yet is silent */
+	if (lp->ilen < RTPM_NSAMPLES) {
+	    memset(lp->frame, 0, sizeof(lp->frame));
+	    continue;
+	}
+	memcpy(lp->frame, lp->ibuf, sizeof(lp->frame));
+	lp->ilen -= RTPM_NSAMPLES;
+	memmove(lp->ibuf, lp->ibuf + RTPM_NSAMPLES,
+	  lp->ilen * sizeof(lp->ibuf[0]));
+	for (i = 0; i < RTPM_NSAMPLES; i++)
+	    mp->sum[i] += lp->frame[i];
+    }
+    return 1;
+}
+
+/*
+ * Build RTP packet with the current frame mix minus participant's own
+ * contribution. Returns length of the packet in the leg's buffer.
+ */
+int
+rtp_mixer_get(struct rtp_mixer_leg *lp)
+{
+    int16_t obuf[RTPM_NSAMPLES];
+    int32_t s;
+    int i;
+
+    for (i = 0; i < RTPM_NSAMPLES; i++) {
+	s = lp->mixer->sum[i] - lp->frame[i];
+	obuf[i] = (s > INT16_MAX) ? INT16_MAX : (s < INT16_MIN) ? INT16_MIN : s;
+    }
+    if (lp->codec->id == RTP_PCMA)
+	g711_sl2alaw(lp->pload, obuf, RTPM_NSAMPLES);
+    else
+	g711_sl2ulaw(lp->pload, obuf, RTPM_NSAMPLES);
+
+    lp->rtp->m = (lp->seq == 0) ? 1 : 0;
+    lp->rtp->pt = lp->codec->id;
+    lp->rtp->ssrc = lp->ssrc;
+    lp->ts += RTPM_NSAMPLES;
+    lp->seq++;
+    lp->rtp->ts = htonl(lp->ts);
+    lp->rtp->seq = htons(lp->seq);
+
+    return (lp->pload - lp->buf) + RTPM_NSAMPLES;
+}
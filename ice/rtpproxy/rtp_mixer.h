@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RTP_MIXER_H_
+#define _RTP_MIXER_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "rtp.h"
+#include "rtpp_defines.h"
+
+struct rtpp_session;
+
+/* Conference is mixed in 20 ms frames of 8 kHz G.711 audio */
+#define	RTPM_PTIME	20
+#define	RTPM_NSAMPLES	(8000 * RTPM_PTIME / 1000)
+/* Maximum amount of audio buffered for each participant */
+#define	RTPM_MAXSAMPLES	(RTPM_NSAMPLES * 4)
+/* Restart the mixing clock if we are lagging more than that, in seconds */
+#define	RTPM_MAXLAG	0.2
+
+struct rtp_mixer_leg {
+    struct rtp_mixer *mixer;
+    struct rtpp_session *sp;
+    int idx;
+    /* Encoding used by participant, the same is used for the mix sent back */
+    const struct rtp_codec *codec;
+    int16_t ibuf[RTPM_MAXSAMPLES];
+    int ilen;
+    /* Participant's contribution to the current frame */
+    int16_t frame[RTPM_NSAMPLES];
+    unsigned char buf[sizeof(rtp_hdr_t) + RTPM_NSAMPLES];
+    rtp_hdr_t *rtp;
+    unsigned char *pload;
+    uint32_t ssrc;
+    uint32_t ts;
+    uint16_t seq;
+    struct rtp_mixer_leg *next;
+};
+
+struct rtp_mixer {
+    char *name;
+    double ntime;
+    int nlegs;
+    struct rtp_mixer_leg *legs;
+    int32_t sum[RTPM_NSAMPLES];
+    struct rtp_mixer *prev;
+    struct rtp_mixer *next;
+};
+
+struct rtp_mixer_leg *rtp_mixer_join(struct cfg *, const char *,
+  struct rtpp_session *, int);
+void rtp_mixer_leave(struct cfg *, struct rtp_mixer_leg *);
+void rtp_mixer_put(struct rtp_mixer_leg *, struct rtp_packet *);
+int rtp_mixer_mix(struct rtp_mixer *, double);
+int rtp_mixer_get(struct rtp_mixer_leg *);
+
+#endif
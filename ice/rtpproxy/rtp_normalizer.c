@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "rtp.h"
+#include "rtp_normalizer.h"
+
+/*
+ * Rewrite RTP header of the packet originating from the source src
+ * before it's sent out. Clock rate of the stream is used to advance
+ * timestamp by the time that has passed since the last packet when
+ * switching sources.
+ */
+void
+rtp_normalizer_apply(struct rtp_normalizer *np, rtp_hdr_t *hdr, int src,
+  int clock_rate, double dtime)
+{
+    uint16_t seq;
+    uint32_t ts;
+    double elapsed;
+    int marker;
+
+    seq = ntohs(hdr->seq);
+    ts = ntohl(hdr->ts);
+    marker = 0;
+
+    if (np->inited == 0) {
+	np->inited = 1;
+	np->src = src;
+	np->issrc = np->ossrc = hdr->ssrc;
+	if (src != RTPN_SRC_RELAY)
+	    np->active = 1;
+    } else if (src != np->src || hdr->ssrc != np->issrc) {
+	if (src != RTPN_SRC_RELAY)
+	    np->active = 1;
+	if (np->active != 0) {
+	    elapsed = (dtime - np->last_time) * clock_rate;
+	    if (elapsed < 1)
+		elapsed = 1;
+	    np->seq_off = np->last_seq + 1 - seq;
+	    np->ts_off = np->last_ts + (uint32_t)elapsed - ts;
+	    marker = 1;
+	} else {
+	    np->ossrc = hdr->ssrc;
+	}
+	np->src = src;
+	np->issrc = hdr->ssrc;
+    }
+
+    if (np->active != 0) {
+	seq += np->seq_off;
+	ts += np->ts_off;
+	hdr->ssrc = np->ossrc;
+	hdr->seq = htons(seq);
+	hdr->ts = htonl(ts);
+	if (marker != 0)
+	    hdr->m = 1;
+    }
+
+    np->last_seq = seq;
+    np->last_ts = ts;
+    np->last_time = dtime;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RTP_NORMALIZER_H_
+#define _RTP_NORMALIZER_H_
+
+#include <stdint.h>
+
+#include "rtp.h"
+
+/* Sources of the packets sent to a leg */
+#define	RTPN_SRC_RELAY	0
+#define	RTPN_SRC_PLAYER	1
+#define	RTPN_SRC_MIXER	2
+
+/*
+ * Keeps SSRC, sequence numbers and timestamps of the stream sent to a
+ * leg continuous when its source changes. Packets pass unchanged until
+ * the first switch to the player or mixer; from then on every packet is
+ * rewritten to look as a continuation of the stream seen before.
+ */
+struct rtp_normalizer {
+    int         inited;
+    int         active;
+
+    /* Current source */
+    int         src;
+    uint32_t    issrc;
+
+    /* Offsets applied to the source */
+    uint32_t    ossrc;
+    uint16_t    seq_off;
+    uint32_t    ts_off;
+
+    /* Last packet sent */
+    uint16_t    last_seq;
+    uint32_t    last_ts;
+    double      last_time;
+};
+
+void rtp_normalizer_apply(struct rtp_normalizer *, rtp_hdr_t *, int, int,
+  double);
+
+#endif
@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef ENABLE_G729
+#include "g729_encoder.h"
+#endif
+#ifdef ENABLE_GSM
+#include "gsm.h"
+#endif
+
+#include "rtp.h"
+#include "rtp_g711.h"
+#include "rtp_prompt.h"
+#include "rtpp_log.h"
+
+#define	LE16(p)	((uint16_t)((p)[0] | ((p)[1] << 8)))
+#define	LE32(p)	((uint32_t)LE16(p) | ((uint32_t)LE16((p) + 2) << 16))
+
+/* Suffixes of the linear sources the prompts can be encoded from */
+static const char *rtp_prompt_sources[] = {"wav", "raw", NULL};
+
+static struct rtp_prompt *rtp_prompts = NULL;
+static pthread_mutex_t rtp_prompts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct rtp_prompt *
+rtp_prompt_insert(const struct stat *stp, int codec, const unsigned char *data,
+  size_t size)
+{
+    struct rtp_prompt *pp;
+
+    pp = malloc(sizeof(*pp));
+    if (pp == NULL)
+	return NULL;
+    memset(pp, 0, sizeof(*pp));
+    pp->dev = stp->st_dev;
+    pp->ino = stp->st_ino;
+    pp->mtime = stp->st_mtime;
+    pp->codec = codec;
+    pp->data = data;
+    pp->size = size;
+
+    pp->next = rtp_prompts;
+    rtp_prompts = pp;
+
+    return pp;
+}
+
+/*
+ * Read the whole file into private memory. The file is not mapped, since
+ * truncating a mapped file under the relay would fault it with SIGBUS.
+ * A file that changes size while being read is rejected.
+ */
+static unsigned char *
+rtp_prompt_read(int fd, const struct stat *stp)
+{
+    unsigned char *data;
+    size_t off;
+    ssize_t len;
+
+    if (stp->st_size == 0)
+	return NULL;
+    data = malloc(stp->st_size);
+    if (data == NULL)
+	return NULL;
+    for (off = 0; off < (size_t)stp->st_size; off += len) {
+	len = pread(fd, data + off, stp->st_size - off, off);
+	if (len <= 0) {
+	    free(data);
+	    return NULL;
+	}
+    }
+    return data;
+}
+
+/*
+ * Locate samples in the WAV file. Only 16-bit mono 8 kHz PCM is
+ * accepted, anything else has to be converted with makeann.
+ */
+static const unsigned char *
+rtp_prompt_wav_data(const unsigned char *data, size_t size, size_t *lenp)
+{
+    const unsigned char *cp, *fmt;
+    size_t left, clen;
+
+    if (size < 12 || memcmp(data, "RIFF", 4) != 0 ||
+      memcmp(data + 8, "WAVE", 4) != 0)
+	return NULL;
+    fmt = NULL;
+    cp = data + 12;
+    left = size - 12;
+    while (left >= 8) {
+	clen = LE32(cp + 4);
+	/* Tolerate truncated data chunk */
+	if (clen > left - 8)
+	    clen = left - 8;
+	if (memcmp(cp, "fmt ", 4) == 0 && clen >= 16) {
+	    fmt = cp + 8;
+	} else if (memcmp(cp, "data", 4) == 0) {
+	    if (fmt == NULL || LE16(fmt) != 1 || LE16(fmt + 2) != 1 ||
+	      LE32(fmt + 4) != 8000 || LE16(fmt + 14) != 16)
+		return NULL;
+	    *lenp = clen;
+	    return cp + 8;
+	}
+	clen += clen & 1;
+	if (clen >= left - 8)
+	    break;
+	cp += 8 + clen;
+	left -= 8 + clen;
+    }
+    return NULL;
+}
+
+/*
+ * Encode nsamples of little-endian 16-bit linear audio, the tail is
+ * padded with silence up to the whole codec frame.
+ */
+static unsigned char *
+rtp_prompt_encode(int codec, const unsigned char *src, size_t nsamples,
+  size_t *sizep)
+{
+    int16_t slbuf[160];
+    unsigned char *data, *dp;
+    size_t i, j, n;
+    int frame_samples, frame_bytes;
+#ifdef ENABLE_G729
+    G729_CTX *ctx_g729;
+#endif
+#ifdef ENABLE_GSM
+    gsm ctx_gsm;
+#endif
+
+    switch (codec) {
+    case RTP_PCMU:
+    case RTP_PCMA:
+	frame_samples = 1;
+	frame_bytes = 1;
+	break;
+
+#ifdef ENABLE_G729
+    case RTP_G729:
+	frame_samples = 80;
+	frame_bytes = 10;
+	break;
+#endif
+
+#ifdef ENABLE_GSM
+    case RTP_GSM:
+	frame_samples = 160;
+	frame_bytes = 33;
+	break;
+#endif
+
+    default:
+	return NULL;
+    }
+
+    if (nsamples == 0)
+	return NULL;
+    *sizep = ((nsamples + frame_samples - 1) / frame_samples) * frame_bytes;
+    data = malloc(*sizep);
+    if (data == NULL)
+	return NULL;
+
+#ifdef ENABLE_G729
+    if (codec == RTP_G729) {
+	ctx_g729 = g729_encoder_new();
+	if (ctx_g729 == NULL) {
+	    free(data);
+	    return NULL;
+	}
+    }
+#endif
+#ifdef ENABLE_GSM
+    if (codec == RTP_GSM) {
+	ctx_gsm = gsm_create();
+	if (ctx_gsm == NULL) {
+	    free(data);
+	    return NULL;
+	}
+    }
+#endif
+
+    dp = data;
+    for (i = 0; i < nsamples; i += n) {
+	n = nsamples - i;
+	if (n > 160)
+	    n = 160;
+	for (j = 0; j < 160; j++)
+	    slbuf[j] = (j < n) ? (int16_t)LE16(src + (i + j) * 2) : 0;
+	switch (codec) {
+	case RTP_PCMU:
+	    g711_sl2ulaw(dp, slbuf, n);
+	    dp += n;
+	    break;
+
+	case RTP_PCMA:
+	    g711_sl2alaw(dp, slbuf, n);
+	    dp += n;
+	    break;
+
+#ifdef ENABLE_G729
+	case RTP_G729:
+	    for (j = 0; j < n; j += 80) {
+		g729_encode_frame(ctx_g729, &(slbuf[j]), dp);
+		dp += 10;
+	    }
+	    break;
+#endif
+
+#ifdef ENABLE_GSM
+	case RTP_GSM:
+	    gsm_encode(ctx_gsm, slbuf, dp);
+	    dp += 33;
+	    break;
+#endif
+	}
+    }
+
+#ifdef ENABLE_G729
+    if (codec == RTP_G729)
+	g729_encoder_destroy(ctx_g729);
+#endif
+#ifdef ENABLE_GSM
+    if (codec == RTP_GSM)
+	gsm_destroy(ctx_gsm);
+#endif
+    return data;
+}
+
+/*
+ * Encode linear source (WAV or raw 16-bit 8 kHz samples) into the codec.
+ */
+static unsigned char *
+rtp_prompt_read_encoded(int fd, const struct stat *stp, int codec,
+  size_t *sizep)
+{
+    const unsigned char *src, *samples;
+    unsigned char *data;
+    size_t len;
+
+    src = rtp_prompt_read(fd, stp);
+    if (src == NULL)
+	return NULL;
+    if (stp->st_size >= 4 && memcmp(src, "RIFF", 4) == 0) {
+	samples = rtp_prompt_wav_data(src, stp->st_size, &len);
+    } else {
+	samples = src;
+	len = stp->st_size;
+    }
+    data = NULL;
+    if (samples != NULL)
+	data = rtp_prompt_encode(codec, samples, len / 2, sizep);
+    free((void *)src);
+    return data;
+}
+
+static void
+rtp_prompt_unload(struct rtp_prompt *pp)
+{
+    struct rtp_prompt **ppp;
+
+    for (ppp = &rtp_prompts; *ppp != NULL; ppp = &(*ppp)->next) {
+	if (*ppp == pp) {
+	    *ppp = pp->next;
+	    break;
+	}
+    }
+    free((void *)pp->data);
+    free(pp);
+}
+
+/*
+ * Find the cached copy of the file, forgetting stale copies of it on
+ * the way. Called with rtp_prompts_lock held.
+ */
+static struct rtp_prompt *
+rtp_prompt_find(const struct stat *stp, int codec)
+{
+    struct rtp_prompt *pp, *npp;
+
+    for (pp = rtp_prompts; pp != NULL; pp = npp) {
+	npp = pp->next;
+	if (pp->dev != stp->st_dev || pp->ino != stp->st_ino ||
+	  pp->codec != codec)
+	    continue;
+	if (pp->mtime == stp->st_mtime &&
+	  (codec != -1 || pp->size == (size_t)stp->st_size))
+	    return pp;
+	/* Stale copy, forget it once nobody uses it */
+	pp->pinned = 0;
+	if (pp->refcnt == 0)
+	    rtp_prompt_unload(pp);
+    }
+    return NULL;
+}
+
+static struct rtp_prompt *
+rtp_prompt_lookup(const char *path, int codec)
+{
+    struct rtp_prompt *pp;
+    struct stat st;
+    unsigned char *data;
+    size_t size;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+	return NULL;
+    if (fstat(fd, &st) == -1) {
+	close(fd);
+	return NULL;
+    }
+
+    pthread_mutex_lock(&rtp_prompts_lock);
+    pp = rtp_prompt_find(&st, codec);
+    if (pp != NULL)
+	pp->refcnt++;
+    pthread_mutex_unlock(&rtp_prompts_lock);
+    if (pp != NULL) {
+	close(fd);
+	return pp;
+    }
+
+    /*
+     * Reading and encoding the file may take a while, don't block other
+     * lookups meanwhile. Whoever inserts the copy first wins the race.
+     */
+    if (codec == -1) {
+	data = rtp_prompt_read(fd, &st);
+	size = st.st_size;
+    } else {
+	data = rtp_prompt_read_encoded(fd, &st, codec, &size);
+    }
+    close(fd);
+    if (data == NULL)
+	return NULL;
+
+    pthread_mutex_lock(&rtp_prompts_lock);
+    pp = rtp_prompt_find(&st, codec);
+    if (pp != NULL) {
+	free(data);
+    } else {
+	pp = rtp_prompt_insert(&st, codec, data, size);
+	if (pp == NULL)
+	    free(data);
+	else if (codec != -1)
+	    /* Encoding is expensive, keep the rendition for the next player */
+	    pp->pinned = 1;
+    }
+    if (pp != NULL)
+	pp->refcnt++;
+    pthread_mutex_unlock(&rtp_prompts_lock);
+
+    return pp;
+}
+
+/*
+ * Get a reference to the prompt stored in the file. Cache is looked up
+ * by the file identity rather than the name, so that the same file is
+ * found regardless of the path it's referred to with, and a prompt that
+ * has been replaced on disk is read again. Returns NULL if the file
+ * can't be opened or is empty.
+ */
+struct rtp_prompt *
+rtp_prompt_get(const char *path)
+{
+
+    return rtp_prompt_lookup(path, -1);
+}
+
+/*
+ * Get a reference to the prompt "<name>" encoded into the codec from its
+ * linear source "<name>.wav" or "<name>.raw". Source is encoded on the
+ * first use and the result is kept for as long as it's referenced.
+ */
+struct rtp_prompt *
+rtp_prompt_get_encoded(const char *name, int codec)
+{
+    struct rtp_prompt *pp;
+    char path[PATH_MAX + 1];
+    int i;
+
+    for (i = 0; rtp_prompt_sources[i] != NULL; i++) {
+	snprintf(path, sizeof(path), "%s.%s", name, rtp_prompt_sources[i]);
+	pp = rtp_prompt_lookup(path, codec);
+	if (pp != NULL)
+	    return pp;
+    }
+    return NULL;
+}
+
+/*
+ * Get a reference to the prompt "<name>" in the codec, either stored
+ * pre-encoded in "<name>.<codec>" or encoded from its linear source.
+ */
+struct rtp_prompt *
+rtp_prompt_get_codec(const char *name, int codec)
+{
+    struct rtp_prompt *pp;
+    char path[PATH_MAX + 1];
+
+    /* Prompts are stored under the static payload type of the codec */
+    snprintf(path, sizeof(path), "%s.%d", name, codec);
+    pp = rtp_prompt_get(path);
+    if (pp == NULL) {
+	/* No pre-encoded prompt, try to encode it from the linear source */
+	pp = rtp_prompt_get_encoded(name, codec);
+    }
+    return pp;
+}
+
+void
+rtp_prompt_release(struct rtp_prompt *pp)
+{
+
+    pthread_mutex_lock(&rtp_prompts_lock);
+    pp->refcnt--;
+    if (pp->refcnt == 0 && pp->pinned == 0)
+	rtp_prompt_unload(pp);
+    pthread_mutex_unlock(&rtp_prompts_lock);
+}
+
+/*
+ * Load all prompt files ("<name>.<payload type>") found in the directory
+ * and keep them in the cache for the lifetime of the process. Returns
+ * number of prompts loaded or -1 if the directory can't be read.
+ */
+int
+rtp_prompt_preload(rtpp_log_t log, const char *dir)
+{
+    DIR *dirp;
+    struct dirent *dp;
+    struct rtp_prompt *pp;
+    const char *cp;
+    char path[PATH_MAX + 1];
+    int n;
+
+    dirp = opendir(dir);
+    if (dirp == NULL) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, log, "can't open prompt directory %s", dir);
+	return -1;
+    }
+    n = 0;
+    while ((dp = readdir(dirp)) != NULL) {
+	cp = strrchr(dp->d_name, '.');
+	if (cp == NULL || cp == dp->d_name || cp[1] == '\0')
+	    continue;
+	for (cp++; isdigit((unsigned char)*cp); cp++)
+	    continue;
+	if (*cp != '\0')
+	    continue;
+	snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+	pp = rtp_prompt_get(path);
+	if (pp == NULL) {
+	    rtpp_log_ewrite(RTPP_LOG_WARN, log, "can't preload prompt %s", path);
+	    continue;
+	}
+	pthread_mutex_lock(&rtp_prompts_lock);
+	pp->pinned = 1;
+	pp->refcnt--;
+	pthread_mutex_unlock(&rtp_prompts_lock);
+	n++;
+    }
+    closedir(dirp);
+    rtpp_log_write(RTPP_LOG_INFO, log, "%d prompts preloaded from %s", n, dir);
+    return n;
+}
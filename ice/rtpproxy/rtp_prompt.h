@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RTP_PROMPT_H_
+#define _RTP_PROMPT_H_
+
+#include <sys/types.h>
+
+#include "rtpp_log.h"
+
+/*
+ * Process-wide cache of the prompt files, each file is read into
+ * memory once and shared by all players using it. Prompts encoded from
+ * the linear source are cached the same way, one rendition per codec.
+ */
+struct rtp_prompt {
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    /* Codec the source has been encoded into, -1 if used as is */
+    int codec;
+    const unsigned char *data;
+    size_t size;
+    int refcnt;
+    /*
+     * Preloaded and encoded prompts stay in the cache when not in use,
+     * until the file they came from changes
+     */
+    int pinned;
+    struct rtp_prompt *next;
+};
+
+struct rtp_prompt *rtp_prompt_get(const char *);
+struct rtp_prompt *rtp_prompt_get_encoded(const char *, int);
+struct rtp_prompt *rtp_prompt_get_codec(const char *, int);
+void rtp_prompt_release(struct rtp_prompt *);
+int rtp_prompt_preload(rtpp_log_t, const char *);
+
+#endif
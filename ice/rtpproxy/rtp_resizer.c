@@ -33,8 +33,12 @@
 #include <stdint.h>
 
 #include "rtp.h"
+#include "rtp_codec.h"
 #include "rtp_resizer.h"
 
+/* Convert milliseconds into the number of samples at given clock rate */
+#define	MS2NSAMPLES(ms, rate)	((ms) * (rate) / 1000)
+
 static int
 max_nsamples(int codec_id)
 {
@@ -63,13 +67,14 @@ rtp_resizer_free(struct rtp_resizer *this)
 }
 
 void
-rtp_resizer_enqueue(struct rtp_resizer *this, struct rtp_packet **pkt)
+rtp_resizer_enqueue(struct rtp_resizer *this, struct rtp_packet **pkt,
+  const struct rtp_codec_map *map)
 {
     struct rtp_packet   *p;
     uint32_t            ref_ts, internal_ts;
-    int                 delta;
+    int                 delta, lead, slack;
 
-    if (rtp_packet_parse(*pkt) != RTP_PARSER_OK)
+    if (rtp_packet_parse(*pkt, map) != RTP_PARSER_OK)
         return;
 
     if ((*pkt)->nsamples == RTP_NSAMPLES_UNKNOWN)
@@ -82,20 +87,28 @@ rtp_resizer_enqueue(struct rtp_resizer *this, struct rtp_packet **pkt)
         *pkt = NULL;
         return;
     }
-    internal_ts = (*pkt)->rtime * 8000.0;
+    if ((*pkt)->clock_rate != this->clock_rate) {
+        /* Timestamp scale has changed, resync */
+        this->clock_rate = (*pkt)->clock_rate;
+        this->tsdelta_inited = 0;
+    }
+    this->output_nsamples = MS2NSAMPLES(this->output_ptime, this->clock_rate);
+    lead = MS2NSAMPLES(5, this->clock_rate);
+    slack = this->output_nsamples + MS2NSAMPLES(20, this->clock_rate);
+    internal_ts = (uint64_t)((*pkt)->rtime * (double)this->clock_rate);
     if (!this->tsdelta_inited) {
-        this->tsdelta = (*pkt)->ts - internal_ts + 40;
+        this->tsdelta = (*pkt)->ts - internal_ts + lead;
         this->tsdelta_inited = 1;
     }
     else {
         ref_ts = internal_ts + this->tsdelta;
         if (ts_less(ref_ts, (*pkt)->ts)) {
-            this->tsdelta = (*pkt)->ts - internal_ts + 40;
+            this->tsdelta = (*pkt)->ts - internal_ts + lead;
 /*            printf("Sync forward\n"); */
         }
-        else if (ts_less((*pkt)->ts + this->output_nsamples + 160, ref_ts)) 
+        else if (ts_less((*pkt)->ts + slack, ref_ts)) 
         {
-            delta = (ref_ts - ((*pkt)->ts + this->output_nsamples + 160)) / 2;
+            delta = (ref_ts - ((*pkt)->ts + slack)) / 2;
             this->tsdelta -= delta;
 /*            printf("Sync backward\n"); */
         }
@@ -213,17 +226,18 @@ rtp_resizer_get(struct rtp_resizer *this, double dtime)
     if (this->queue.first == NULL)
         return NULL;
 
-    ref_ts = (dtime * 8000.0) + this->tsdelta;
+    ref_ts = (uint64_t)(dtime * (double)this->clock_rate) + this->tsdelta;
 
     /* Wait untill enough data has arrived or timeout occured */
     if (this->nsamples_total < this->output_nsamples &&
-        ts_less(ref_ts, this->queue.first->ts + this->output_nsamples + 160))
+        ts_less(ref_ts, this->queue.first->ts + this->output_nsamples +
+        MS2NSAMPLES(20, this->clock_rate)))
     {
         return NULL;
     }
 
     output_nsamples = this->output_nsamples;
-    max = max_nsamples(this->queue.first->data.header.pt);
+    max = max_nsamples(this->queue.first->codec->id);
     if (max > 0 && output_nsamples > max)
         output_nsamples = max;
 
@@ -40,6 +40,8 @@ struct rtp_resizer {
     int         tsdelta_inited;
     uint32_t    tsdelta;
 
+    int         output_ptime;		/* requested packet length, ms */
+    int         clock_rate;
     int         output_nsamples;
 
     struct {
@@ -48,11 +50,12 @@ struct rtp_resizer {
     } queue;
 };
 
-void rtp_resizer_enqueue(struct rtp_resizer *, struct rtp_packet **);
+void rtp_resizer_enqueue(struct rtp_resizer *, struct rtp_packet **,
+  const struct rtp_codec_map *);
 struct rtp_packet *rtp_resizer_get(struct rtp_resizer *, double);
 
 void rtp_resizer_free(struct rtp_resizer *);
 
-#define is_rtp_resizer_enabled(resizer) ((resizer).output_nsamples > 0)
+#define is_rtp_resizer_enabled(resizer) ((resizer).output_ptime > 0)
 
 #endif /* __RTP_RESIZER_H */
@@ -30,7 +30,7 @@
 #include <sys/time.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
-#include <fcntl.h>
+#include <assert.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,30 +41,106 @@
 #include "rtp_server.h"
 #include "rtpp_util.h"
 #include "rtp.h"
+#include "rtp_codec.h"
+#include "rtp_prompt.h"
 
+/*
+ * Size and duration (in ms) of the smallest chunk of the prompt that
+ * can be sent in a packet.
+ */
+static int
+rtp_server_framing(const struct rtp_codec *codec, int *bytes_per_frame,
+  int *ticks_per_frame)
+{
+
+    switch (codec->id) {
+    case RTP_PCMU:
+    case RTP_PCMA:
+	*bytes_per_frame = 8;
+	*ticks_per_frame = 1;
+	break;
+
+    case RTP_G729:
+	/* 10 ms per 8 kbps G.729 frame */
+	*bytes_per_frame = 10;
+	*ticks_per_frame = 10;
+	break;
+
+    case RTP_G723:
+	/* 30 ms per 6.3 kbps G.723 frame */
+	*bytes_per_frame = 24;
+	*ticks_per_frame = 30;
+	break;
+
+    case RTP_GSM:
+	/* 20 ms per 13 kbps GSM frame */
+	*bytes_per_frame = 33;
+	*ticks_per_frame = 20;
+	break;
+
+    case RTP_G722:
+	*bytes_per_frame = 8;
+	*ticks_per_frame = 1;
+	break;
+
+    default:
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Create player for the prompt "<name>.<codec>". Packets carry ptime ms
+ * worth of audio, rounded up to the whole number of codec frames, or
+ * RTPS_TICKS_DFLT if ptime is zero.
+ */
 struct rtp_server *
-rtp_server_new(const char *name, rtp_type_t codec, int loop)
+rtp_server_new(const char *name, int pt, int loop,
+  const struct rtp_codec_map *map, int ptime)
 {
     struct rtp_server *rp;
-    int fd;
-    char path[PATH_MAX + 1];
+    const struct rtp_codec_ent *cent;
+    struct rtp_prompt *prompt;
+    int bytes_per_frame, ticks_per_frame, number_of_frames, max_frames;
+
+    cent = rtp_codec_lookup(map, pt);
+    if (cent == NULL)
+	return NULL;
+    if (rtp_server_framing(cent->codec, &bytes_per_frame, &ticks_per_frame) != 0)
+	return NULL;
+
+    if (ptime <= 0)
+	ptime = RTPS_TICKS_DFLT;
+    else if (ptime < RTPS_TICKS_MIN)
+	ptime = RTPS_TICKS_MIN;
+    number_of_frames = ptime / ticks_per_frame;
+    if (ptime % ticks_per_frame != 0)
+	number_of_frames++;
+    max_frames = (sizeof(rp->buf) - sizeof(rtp_hdr_t)) / bytes_per_frame;
+    if (number_of_frames > max_frames)
+	number_of_frames = max_frames;
 
-    sprintf(path, "%s.%d", name, codec);
-    fd = open(path, O_RDONLY);
-    if (fd == -1)
+    prompt = rtp_prompt_get_codec(name, cent->codec->id);
+    if (prompt == NULL)
 	return NULL;
 
     rp = malloc(sizeof(*rp));
     if (rp == NULL) {
-	close(fd);
+	rtp_prompt_release(prompt);
 	return NULL;
     }
 
     memset(rp, 0, sizeof(*rp));
 
     rp->btime = -1;
-    rp->fd = fd;
+    rp->ntime = 0;
+    rp->hidx = -1;
+    rp->prompt = prompt;
     rp->loop = (loop > 0) ? loop - 1 : loop;
+    rp->codec = cent->codec;
+    rp->clock_rate = cent->clock_rate;
+    rp->rlen = bytes_per_frame * number_of_frames;
+    rp->rticks = ticks_per_frame * number_of_frames;
 
     rp->rtp = (rtp_hdr_t *)rp->buf;
     rp->rtp->version = 2;
@@ -72,20 +148,48 @@ rtp_server_new(const char *name, rtp_type_t codec, int loop)
     rp->rtp->x = 0;
     rp->rtp->cc = 0;
     rp->rtp->m = 1;
-    rp->rtp->pt = codec;
-    rp->rtp->ts = 0;
-    rp->rtp->seq = 0;
-    rp->rtp->ssrc = random();
+    rp->rtp->pt = pt;
+    rp->ssrc = random();
     rp->pload = rp->buf + RTP_HDR_LEN(rp->rtp);
 
     return rp;
 }
 
+/*
+ * Find looping broadcast player for the prompt "<name>.<codec>" with the
+ * given packetization, or create one if this is the first listener.
+ */
+struct rtp_server *
+rtp_server_bcast(struct cfg *cf, const char *name, int pt,
+  const struct rtp_codec_map *map, int ptime)
+{
+    struct rtp_server *rp, *tp;
+
+    rp = rtp_server_new(name, pt, -1, map, ptime);
+    if (rp == NULL)
+	return NULL;
+
+    /* Prompt cache returns the same object for the same file */
+    for (tp = cf->rtp_bcasts; tp != NULL; tp = tp->bnext) {
+	if (tp->prompt == rp->prompt && tp->rticks == rp->rticks) {
+	    rtp_server_free(rp);
+	    return tp;
+	}
+    }
+
+    rp->bcast = 1;
+    rp->bnext = cf->rtp_bcasts;
+    if (cf->rtp_bcasts != NULL)
+	cf->rtp_bcasts->bprev = rp;
+    cf->rtp_bcasts = rp;
+    return rp;
+}
+
 void
 rtp_server_free(struct rtp_server *rp)
 {
 
-    close(rp->fd);
+    rtp_prompt_release(rp->prompt);
     free(rp);
 }
 
@@ -93,86 +197,186 @@ int
 rtp_server_get(struct rtp_server *rp, double dtime)
 {
     uint32_t ts;
-    int rlen, rticks, bytes_per_frame, ticks_per_frame, number_of_frames;
+    int rlen;
 
     if (rp->btime == -1)
 	rp->btime = dtime;
 
-    ts = ntohl(rp->rtp->ts);
+    ts = rp->ts;
 
-    if (rp->btime + ((double)ts / RTPS_SRATE) > dtime)
+    rp->ntime = rp->btime + ((double)ts / rp->clock_rate);
+    if (rp->ntime > dtime)
 	return RTPS_LATER;
 
-    switch (rp->rtp->pt) {
-    case RTP_PCMU:
-    case RTP_PCMA:
-	bytes_per_frame = 8;
-	ticks_per_frame = 1;
-	break;
+    rlen = rp->rlen;
 
-    case RTP_G729:
-	/* 10 ms per 8 kbps G.729 frame */
-	bytes_per_frame = 10;
-	ticks_per_frame = 10;
-	break;
+    if (rp->pos + rlen > rp->prompt->size) {
+	if (rp->loop == 0 || rlen > rp->prompt->size)
+	    return RTPS_EOF;
+	rp->pos = 0;
+	if (rp->loop != -1)
+	    rp->loop -= 1;
+    }
+    memcpy(rp->pload, rp->prompt->data + rp->pos, rlen);
+    rp->pos += rlen;
 
-    case RTP_G723:
-	/* 30 ms per 6.3 kbps G.723 frame */
-	bytes_per_frame = 24;
-	ticks_per_frame = 30;
-	break;
+    rp->rtp->m = (rp->seq == 0) ? 1 : 0;
+    rp->rtp->ssrc = rp->ssrc;
 
-    case RTP_GSM:
-	/* 20 ms per 13 kbps GSM frame */
-	bytes_per_frame = 33;
-	ticks_per_frame = 20;
-	break;
+    rp->ts = ts + (rp->clock_rate * rp->rticks / 1000);
+    rp->seq++;
+    rp->rtp->ts = htonl(rp->ts);
+    rp->rtp->seq = htons(rp->seq);
+    rp->ntime = rp->btime + ((double)rp->ts / rp->clock_rate);
 
-    case RTP_G722:
-	bytes_per_frame = 8;
-	ticks_per_frame = 1;
-	break;
+    return (rp->pload - rp->buf) + rlen;
+}
 
-    default:
-	return RTPS_ERROR;
-    }
+/*
+ * Active players are kept in the binary min-heap cf->rtp_servers ordered
+ * by the time the next packet is due, so that only players that are
+ * due need to be looked at.
+ */
+static void
+rtp_server_heap_set(struct cfg *cf, int i, struct rtp_server *rp)
+{
 
-    number_of_frames = RTPS_TICKS_MIN / ticks_per_frame;
-    if (RTPS_TICKS_MIN % ticks_per_frame != 0)
-	number_of_frames++;
+    cf->rtp_servers[i] = rp;
+    rp->hidx = i;
+}
 
-    rlen = bytes_per_frame * number_of_frames;
-    rticks = ticks_per_frame * number_of_frames;
+static void
+rtp_server_heap_up(struct cfg *cf, int i)
+{
+    struct rtp_server *rp;
+    int parent;
 
-    if (read(rp->fd, rp->pload, rlen) != rlen) {
-	if (rp->loop == 0 || lseek(rp->fd, 0, SEEK_SET) == -1 ||
-	  read(rp->fd, rp->pload, rlen) != rlen)
-	    return RTPS_EOF;
-	if (rp->loop != -1)
-	    rp->loop -= 1;
+    rp = cf->rtp_servers[i];
+    while (i > 0) {
+	parent = (i - 1) / 2;
+	if (cf->rtp_servers[parent]->ntime <= rp->ntime)
+	    break;
+	rtp_server_heap_set(cf, i, cf->rtp_servers[parent]);
+	i = parent;
     }
+    rtp_server_heap_set(cf, i, rp);
+}
 
-    if (rp->rtp->m != 0 && ntohs(rp->rtp->seq) != 0) {
-	rp->rtp->m = 0;
+static void
+rtp_server_heap_down(struct cfg *cf, int i)
+{
+    struct rtp_server *rp;
+    int child;
+
+    rp = cf->rtp_servers[i];
+    for (;;) {
+	child = i * 2 + 1;
+	if (child >= cf->rtp_nservers)
+	    break;
+	if (child + 1 < cf->rtp_nservers &&
+	  cf->rtp_servers[child + 1]->ntime < cf->rtp_servers[child]->ntime)
+	    child++;
+	if (rp->ntime <= cf->rtp_servers[child]->ntime)
+	    break;
+	rtp_server_heap_set(cf, i, cf->rtp_servers[child]);
+	i = child;
     }
+    rtp_server_heap_set(cf, i, rp);
+}
 
-    rp->rtp->ts = htonl(ts + (RTPS_SRATE * rticks / 1000));
-    rp->rtp->seq = htons(ntohs(rp->rtp->seq) + 1);
+static void
+append_server(struct cfg *cf, struct rtp_server *rp)
+{
 
-    return (rp->pload - rp->buf) + rlen;
+    cf->rtp_servers[cf->rtp_nservers] = rp;
+    rp->hidx = cf->rtp_nservers;
+    cf->rtp_nservers++;
+    rtp_server_heap_up(cf, rp->hidx);
+}
+
+static void
+remove_server(struct cfg *cf, struct rtp_server *rp)
+{
+    int i;
+
+    i = rp->hidx;
+    assert(cf->rtp_servers[i] == rp);
+    cf->rtp_nservers--;
+    rp->hidx = -1;
+    if (i == cf->rtp_nservers)
+	return;
+    rtp_server_heap_set(cf, i, cf->rtp_servers[cf->rtp_nservers]);
+    rtp_server_heap_up(cf, i);
+    rtp_server_heap_down(cf, cf->rtp_servers[i]->hidx);
+}
+
+/* Move player to its place in the heap after its ntime has changed */
+void
+reschedule_server(struct cfg *cf, struct rtp_server *rp)
+{
+
+    rtp_server_heap_up(cf, rp->hidx);
+    rtp_server_heap_down(cf, rp->hidx);
 }
 
+/*
+ * Attach leg sidx of the session to the player, scheduling the player if
+ * it's the first one.
+ */
+int
+rtp_server_subscribe(struct cfg *cf, struct rtp_server *rp,
+  struct rtpp_session *sp, int sidx, int pt)
+{
+    struct rtp_server_sub *sub;
+
+    sub = malloc(sizeof(*sub));
+    if (sub == NULL)
+	return -1;
+    sub->sp = sp;
+    sub->sidx = sidx;
+    sub->pt = pt;
+    sub->next = rp->subs;
+    rp->subs = sub;
+    rp->nsubs++;
+    sp->rtps[sidx] = rp;
+
+    if (rp->hidx == -1)
+	append_server(cf, rp);
+    return 0;
+}
+
+/*
+ * Detach leg sidx of the session from the player, the player is destroyed
+ * once the last leg is gone.
+ */
 void
-append_server(struct cfg *cf, struct rtpp_session *sp)
+rtp_server_unsubscribe(struct cfg *cf, struct rtp_server *rp,
+  struct rtpp_session *sp, int sidx)
 {
+    struct rtp_server_sub **subp, *sub;
 
-    if (sp->rtps[0] != NULL || sp->rtps[1] != NULL) {
-	if (sp->sridx == -1) {
-	    cf->rtp_servers[cf->rtp_nsessions] = sp;
-	    sp->sridx = cf->rtp_nsessions;
-	    cf->rtp_nsessions++;
+    for (subp = &rp->subs; *subp != NULL; subp = &(*subp)->next) {
+	sub = *subp;
+	if (sub->sp == sp && sub->sidx == sidx) {
+	    *subp = sub->next;
+	    free(sub);
+	    rp->nsubs--;
+	    break;
 	}
-    } else {
-	sp->sridx = -1;
     }
+    sp->rtps[sidx] = NULL;
+    if (rp->nsubs > 0)
+	return;
+
+    if (rp->hidx != -1)
+	remove_server(cf, rp);
+    if (rp->bcast) {
+	if (rp->bprev != NULL)
+	    rp->bprev->bnext = rp->bnext;
+	else
+	    cf->rtp_bcasts = rp->bnext;
+	if (rp->bnext != NULL)
+	    rp->bnext->bprev = rp->bprev;
+    }
+    rtp_server_free(rp);
 }
@@ -32,16 +32,52 @@
 #include <sys/types.h>
 
 #include "rtp.h"
+#include "rtp_prompt.h"
 #include "rtpp_defines.h"
 #include "rtpp_session.h"
 
+/* Session leg the player is sending to */
+struct rtp_server_sub {
+    struct rtpp_session *sp;
+    int sidx;
+    /* Payload type the codec is known under by the leg */
+    int pt;
+    struct rtp_server_sub *next;
+};
+
 struct rtp_server {
     double btime;
+    /* Time when the next packet is due */
+    double ntime;
+    /* Position in the heap of active players, -1 if not there */
+    int hidx;
+    struct rtp_server_sub *subs;
+    int nsubs;
+    /*
+     * Broadcast players are shared by all legs playing the same prompt
+     * with the same packetization and are linked into cf->rtp_bcasts.
+     */
+    int bcast;
+    struct rtp_server *bprev;
+    struct rtp_server *bnext;
     unsigned char buf[1024];
     rtp_hdr_t *rtp;
     unsigned char *pload;
-    int fd;
+    struct rtp_prompt *prompt;
+    size_t pos;
     int loop;
+    /*
+     * Header fields are kept separately and written into the buffer on
+     * each packet, since the header may be rewritten after it's returned.
+     */
+    uint32_t ssrc;
+    uint32_t ts;
+    uint16_t seq;
+    const struct rtp_codec *codec;
+    int clock_rate;
+    /* Size and duration (in ms) of each packet's payload */
+    int rlen;
+    int rticks;
 };
 
 #define	RTPS_LATER	(0)
@@ -49,16 +85,22 @@ struct rtp_server {
 #define	RTPS_ERROR	(-2)
 
 /*
- * Minimum length of each RTP packet in ms.
+ * Minimum and default length of each RTP packet in ms.
  * Actual length may differ due to codec's framing constrains.
  */
 #define	RTPS_TICKS_MIN	10
+#define	RTPS_TICKS_DFLT	20
 
-#define	RTPS_SRATE	8000
-
-struct rtp_server *rtp_server_new(const char *, rtp_type_t, int);
+struct rtp_server *rtp_server_new(const char *, int, int,
+  const struct rtp_codec_map *, int);
+struct rtp_server *rtp_server_bcast(struct cfg *, const char *, int,
+  const struct rtp_codec_map *, int);
 void rtp_server_free(struct rtp_server *);
 int rtp_server_get(struct rtp_server *, double);
-void append_server(struct cfg *, struct rtpp_session *);
+int rtp_server_subscribe(struct cfg *, struct rtp_server *,
+  struct rtpp_session *, int, int);
+void rtp_server_unsubscribe(struct cfg *, struct rtp_server *,
+  struct rtpp_session *, int);
+void reschedule_server(struct cfg *, struct rtp_server *);
 
 #endif
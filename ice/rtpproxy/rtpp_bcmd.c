@@ -0,0 +1,545 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <ctype.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtpp_defines.h"
+#include "rtpp_bcmd.h"
+#include "rtpp_command.h"
+#include "rtpp_log.h"
+#include "rtpp_util.h"
+
+#define	BC_INT		0
+#define	BC_STR		1
+#define	BC_LIST		2
+#define	BC_DICT		3
+
+/* Maximum nesting of lists and dictionaries in the message */
+#define	BC_MAX_DEPTH	8
+/* Integers with more digits could overflow long long */
+#define	BC_INT_DIGITS	18
+
+/*
+ * Value parsed from the message. Strings are not copied, s points into
+ * the message, for lists and dictionaries it points at the first element.
+ */
+struct bc_val {
+    int type;
+    const char *s;
+    int len;
+    long long i;
+    const char *ep;		/* End of the value */
+};
+
+/* Reply being built */
+struct bc_out {
+    char *buf;
+    int size;
+    int len;
+    int overflow;
+};
+
+struct bcmd_op {
+    const char *name;
+    char cmd;			/* Legacy command implementing the operation */
+    int nreq;			/* Number of mandatory parameters */
+    /* Parameters in the order of legacy command arguments */
+    const char *params[8];
+};
+
+static const struct bcmd_op bcmd_ops[] = {
+    { "update", 'U', 4, { "call-id", "remote-ip", "remote-port", "from-tag",
+      "to-tag", "notify-socket", "notify-tag", NULL } },
+    { "lookup", 'L', 4, { "call-id", "remote-ip", "remote-port", "from-tag",
+      "to-tag", "notify-socket", "notify-tag", NULL } },
+    { "delete", 'D', 2, { "call-id", "from-tag", "to-tag", NULL } },
+    { "play", 'P', 4, { "call-id", "prompt", "codecs", "from-tag", "to-tag",
+      NULL } },
+    { "noplay", 'S', 2, { "call-id", "from-tag", "to-tag", NULL } },
+    { "record", 'R', 2, { "call-id", "from-tag", "to-tag", NULL } },
+    { "copy", 'C', 3, { "call-id", "target", "from-tag", "to-tag", NULL } },
+    { "mix", 'M', 3, { "call-id", "conference", "from-tag", "to-tag", NULL } },
+    { "fork", 'F', 3, { "call-id", "target", "from-tag", "to-tag", NULL } },
+    { "query", 'Q', 2, { "call-id", "from-tag", "to-tag", NULL } },
+    { "delete-all", 'X', 0, { NULL } },
+    { "version", 'V', 0, { NULL } },
+    { "info", 'I', 0, { NULL } },
+    { NULL, 0, 0, { NULL } }
+};
+
+/* Named parameters mapped onto the legacy command modifiers */
+struct bcmd_mod {
+    const char *name;
+    char mod;
+    int has_value;
+    const char *cmds;		/* Commands taking the modifier */
+};
+
+static const struct bcmd_mod bcmd_mods[] = {
+    { "asymmetric", 'a', 0, "UL" },
+    { "symmetric", 's', 0, "UL" },
+    { "external", 'e', 0, "UL" },
+    { "internal", 'i', 0, "UL" },
+    { "ipv6", '6', 0, "UL" },
+    { "weak", 'w', 0, "UL" },
+    { "dtmf", 'd', 0, "UL" },
+    { "ptime", 'z', 1, "ULP" },
+    { "transcode", 't', 1, "UL" },
+    { "codecs", 'c', 1, "UL" },
+    { "local-ip", 'l', 1, "UL" },
+    { "local-for", 'r', 1, "UL" },
+    { "broadcast", 'b', 0, "P" },
+    { NULL, 0, 0, NULL }
+};
+
+static const char *
+bc_parse(const char *p, const char *ep, struct bc_val *v, int depth)
+{
+    struct bc_val tv;
+    const char *cp;
+    long long n;
+    int neg;
+
+    if (p >= ep)
+	return NULL;
+    switch (*p) {
+    case 'i':
+	p++;
+	neg = (p < ep && *p == '-');
+	if (neg)
+	    p++;
+	if (p >= ep || !isdigit((unsigned char)*p))
+	    return NULL;
+	for (n = 0, cp = p; p < ep && isdigit((unsigned char)*p); p++) {
+	    if (p - cp >= BC_INT_DIGITS)
+		return NULL;
+	    n = n * 10 + (*p - '0');
+	}
+	if (p >= ep || *p != 'e')
+	    return NULL;
+	v->type = BC_INT;
+	v->i = neg ? -n : n;
+	v->ep = p + 1;
+	return v->ep;
+
+    case 'l':
+    case 'd':
+	if (depth >= BC_MAX_DEPTH)
+	    return NULL;
+	v->type = (*p == 'l') ? BC_LIST : BC_DICT;
+	v->s = ++p;
+	for (n = 0; p < ep && *p != 'e'; n++) {
+	    /* Dictionary keys are strings */
+	    if (v->type == BC_DICT && n % 2 == 0 && !isdigit((unsigned char)*p))
+		return NULL;
+	    p = bc_parse(p, ep, &tv, depth + 1);
+	    if (p == NULL)
+		return NULL;
+	}
+	if (p >= ep || (v->type == BC_DICT && n % 2 != 0))
+	    return NULL;
+	v->ep = p + 1;
+	return v->ep;
+
+    default:
+	for (n = 0, cp = p; cp < ep && isdigit((unsigned char)*cp); cp++) {
+	    n = n * 10 + (*cp - '0');
+	    if (n > ep - p)
+		return NULL;
+	}
+	if (cp == p || cp >= ep || *cp != ':' || n > ep - cp - 1)
+	    return NULL;
+	v->type = BC_STR;
+	v->s = cp + 1;
+	v->len = n;
+	v->ep = v->s + n;
+	return v->ep;
+    }
+}
+
+/* Get next element of the list or dictionary, which has been parsed already */
+static int
+bc_next(const struct bc_val *c, const char **pp, struct bc_val *v)
+{
+
+    if (**pp == 'e')
+	return 0;
+    *pp = bc_parse(*pp, c->ep, v, 0);
+    return 1;
+}
+
+static int
+bc_streq(const struct bc_val *v, const char *s)
+{
+
+    return (v->type == BC_STR && (int)strlen(s) == v->len &&
+      memcmp(v->s, s, v->len) == 0);
+}
+
+/* Look up the key in the dictionary, which has been parsed already */
+static int
+bc_dict_get(const struct bc_val *d, const char *key, struct bc_val *v)
+{
+    struct bc_val k;
+    const char *p;
+
+    for (p = d->s; bc_next(d, &p, &k) != 0;) {
+	bc_next(d, &p, v);
+	if (bc_streq(&k, key))
+	    return 1;
+    }
+    return 0;
+}
+
+static void
+bc_raw(struct bc_out *o, const char *s, int len)
+{
+
+    if (o->len + len >= o->size) {
+	o->overflow = 1;
+	return;
+    }
+    memcpy(o->buf + o->len, s, len);
+    o->len += len;
+}
+
+static void
+bc_str(struct bc_out *o, const char *s, int len)
+{
+    char tmp[16];
+
+    bc_raw(o, tmp, sprintf(tmp, "%d:", len));
+    bc_raw(o, s, len);
+}
+
+static void
+bc_kstr(struct bc_out *o, const char *key, const char *s)
+{
+
+    bc_str(o, key, strlen(key));
+    bc_str(o, s, strlen(s));
+}
+
+static void
+bc_kint(struct bc_out *o, const char *key, long long i)
+{
+    char tmp[32];
+
+    bc_str(o, key, strlen(key));
+    bc_raw(o, tmp, sprintf(tmp, "i%llde", i));
+}
+
+static void
+bcmd_error(struct bc_out *o, int ecode, const char *reason)
+{
+
+    bc_raw(o, "d", 1);
+    bc_kint(o, "error-code", ecode);
+    if (reason != NULL)
+	bc_kstr(o, "error-reason", reason);
+    bc_kstr(o, "result", "error");
+    bc_raw(o, "e", 1);
+}
+
+/* Copy parameter value into the command buffer, NULL if it doesn't fit */
+static char *
+bcmd_put(struct rtpp_command *sub, int *off, const struct bc_val *v)
+{
+    char *cp;
+    int len;
+
+    cp = sub->buf + *off;
+    len = sizeof(sub->buf) - *off;
+    if (v->type == BC_INT) {
+	if (snprintf(cp, len, "%lld", v->i) >= len)
+	    return NULL;
+    } else if (v->type == BC_STR && v->len > 0 && v->len < len &&
+      memchr(v->s, '\0', v->len) == NULL) {
+	memcpy(cp, v->s, v->len);
+	cp[v->len] = '\0';
+    } else {
+	return NULL;
+    }
+    *off += strlen(cp) + 1;
+    return cp;
+}
+
+static int
+bcmd_flag(const struct bc_val *v)
+{
+
+    return ((v->type == BC_INT && v->i != 0) ||
+      (v->type == BC_STR && v->len > 0));
+}
+
+static void
+bcmd_info(struct cfg *cf, struct bc_out *o)
+{
+
+    pthread_mutex_lock(&cf->sessinfo.lock);
+    bc_raw(o, "d", 1);
+    bc_kint(o, "active-sessions", cf->sessions_active);
+    bc_kint(o, "active-streams", cf->sessinfo.nsessions / 2);
+    bc_kstr(o, "result", "ok");
+    bc_kint(o, "sessions-created", cf->sessions_created);
+    bc_raw(o, "e", 1);
+    pthread_mutex_unlock(&cf->sessinfo.lock);
+}
+
+/* Convert reply to the legacy command into the result */
+static void
+bcmd_result(const struct bcmd_op *op, int feature, char *rep, struct bc_out *o)
+{
+    char *argv[5], *cp;
+    int argc;
+
+    if (rep[0] == 'E' && isdigit((unsigned char)rep[1])) {
+	bcmd_error(o, atoi(rep + 1), NULL);
+	return;
+    }
+    cp = rep;
+    for (argc = 0; argc < 5 && (argv[argc] = rtpp_strsep(&cp, "\r\n\t ")) != NULL;)
+	if (*argv[argc] != '\0')
+	    argc++;
+    if (argc == 0) {
+	bcmd_error(o, 0, "no reply");
+	return;
+    }
+
+    /* Keys go in the sorted order */
+    bc_raw(o, "d", 1);
+    switch (op->cmd) {
+    case 'U':
+    case 'L':
+	if (argc > 1)
+	    bc_kstr(o, "ip", argv[1]);
+	if (argc > 2)
+	    bc_kstr(o, "ip-family", "IP6");
+	bc_kint(o, "port", atoi(argv[0]));
+	bc_kstr(o, "result", "ok");
+	break;
+
+    case 'Q':
+	if (argc == 5) {
+	    bc_kint(o, "dropped", strtoull(argv[4], NULL, 10));
+	    bc_kint(o, "packets-from", strtoull(argv[1], NULL, 10));
+	    bc_kint(o, "packets-to", strtoull(argv[2], NULL, 10));
+	    bc_kint(o, "relayed", strtoull(argv[3], NULL, 10));
+	}
+	bc_kstr(o, "result", "ok");
+	if (argc == 5)
+	    bc_kint(o, "ttl", atoi(argv[0]));
+	break;
+
+    case 'V':
+	bc_kstr(o, "result", "ok");
+	bc_kint(o, feature ? "supported" : "version", atoll(argv[0]));
+	break;
+
+    default:
+	bc_kstr(o, "result", "ok");
+	break;
+    }
+    bc_raw(o, "e", 1);
+}
+
+/* Perform single operation described by the dictionary */
+static void
+bcmd_op(struct cfg *cf, int controlfd, struct rtpp_command *cmd,
+  const struct bc_val *d, struct bc_out *o, double dtime)
+{
+    const struct bcmd_op *op;
+    const struct bcmd_mod *mod;
+    struct rtpp_command sub;
+    struct bc_val v;
+    char rep[1024 * 8], *cp;
+    int off, i, feature;
+
+    if (d->type != BC_DICT || bc_dict_get(d, "op", &v) == 0) {
+	bcmd_error(o, 0, "operation is not specified");
+	return;
+    }
+    for (op = bcmd_ops; op->name != NULL && !bc_streq(&v, op->name); op++)
+	continue;
+    if (op->name == NULL) {
+	bcmd_error(o, 3, "unknown operation");
+	return;
+    }
+    if (op->cmd == 'I') {
+	bcmd_info(cf, o);
+	return;
+    }
+
+    memset(&sub, 0, sizeof(sub));
+    memcpy(&sub.raddr, &cmd->raddr, sizeof(sub.raddr));
+    sub.rlen = cmd->rlen;
+
+    /* Command name along with modifiers goes first */
+    off = 0;
+    sub.buf[off++] = op->cmd;
+    feature = 0;
+    if (op->cmd == 'V' && bc_dict_get(d, "feature", &v) != 0) {
+	sub.buf[off++] = 'F';
+	feature = 1;
+    }
+    if (op->cmd == 'P' && bc_dict_get(d, "count", &v) != 0) {
+	if (v.type != BC_INT) {
+	    bcmd_error(o, 4, "invalid count");
+	    return;
+	}
+	off += sprintf(sub.buf + off, "%lld", v.i);
+    }
+    for (mod = bcmd_mods; mod->name != NULL; mod++) {
+	if (strchr(mod->cmds, op->cmd) == NULL ||
+	  bc_dict_get(d, mod->name, &v) == 0)
+	    continue;
+	if (mod->has_value == 0) {
+	    if (bcmd_flag(&v))
+		sub.buf[off++] = mod->mod;
+	    continue;
+	}
+	sub.buf[off++] = mod->mod;
+	if (bcmd_put(&sub, &off, &v) == NULL) {
+	    bcmd_error(o, 4, "invalid parameter");
+	    return;
+	}
+	/* Value is part of the same argument */
+	off--;
+    }
+    sub.buf[off++] = '\0';
+    sub.argv[sub.argc++] = sub.buf;
+
+    if (feature != 0) {
+	bc_dict_get(d, "feature", &v);
+	if ((sub.argv[sub.argc++] = bcmd_put(&sub, &off, &v)) == NULL) {
+	    bcmd_error(o, 4, "invalid feature");
+	    return;
+	}
+    }
+    for (i = 0; op->params[i] != NULL; i++) {
+	if (bc_dict_get(d, op->params[i], &v) == 0) {
+	    if (i < op->nreq) {
+		bcmd_error(o, 4, "mandatory parameter is missing");
+		return;
+	    }
+	    break;
+	}
+	cp = bcmd_put(&sub, &off, &v);
+	if (cp == NULL) {
+	    bcmd_error(o, 4, "invalid parameter");
+	    return;
+	}
+	sub.argv[sub.argc++] = cp;
+    }
+
+    /* Collect reply to the legacy command instead of sending it */
+    rep[0] = '\0';
+    sub.rcap = rep;
+    sub.rcap_size = sizeof(rep);
+    handle_command(cf, controlfd, &sub, dtime);
+    bcmd_result(op, feature, rep, o);
+}
+
+/*
+ * Find call-id the structured command refers to, so that it can be routed
+ * to the worker owning the call. For the message carrying multiple
+ * operations, call-id of the first one is used. Returns 0 if there is
+ * none.
+ */
+int
+rtpp_bcmd_call_id(const struct rtpp_command *cmd, const char **idp, int *lenp)
+{
+    struct bc_val msg, ops, v;
+    const char *p;
+
+    p = bc_parse(cmd->bmsg, cmd->bmsg + cmd->bmsg_len, &msg, 0);
+    if (p == NULL || msg.type != BC_DICT)
+	return 0;
+    if (bc_dict_get(&msg, "ops", &ops) != 0) {
+	p = ops.s;
+	if (ops.type != BC_LIST || bc_next(&ops, &p, &msg) == 0 ||
+	  p == NULL || msg.type != BC_DICT)
+	    return 0;
+    }
+    if (bc_dict_get(&msg, "call-id", &v) == 0 || v.type != BC_STR)
+	return 0;
+    *idp = v.s;
+    *lenp = v.len;
+    return 1;
+}
+
+/*
+ * Handle structured command, called by handle_command() with the
+ * glock held.
+ */
+int
+rtpp_bcmd_handle(struct cfg *cf, int controlfd, struct rtpp_command *cmd,
+  double dtime)
+{
+    struct bc_val msg, ops, v;
+    struct bc_out o;
+    const char *p, *ep;
+    char buf[1024 * 8];
+
+    o.buf = buf;
+    o.size = sizeof(buf);
+    o.len = 0;
+    o.overflow = 0;
+
+    ep = cmd->bmsg + cmd->bmsg_len;
+    p = bc_parse(cmd->bmsg, ep, &msg, 0);
+    /* Allow trailing whitespace */
+    while (p != NULL && p < ep && isspace((unsigned char)*p))
+	p++;
+    if (p == NULL || p != ep || msg.type != BC_DICT) {
+	rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "malformed structured command");
+	bcmd_error(&o, 0, "malformed message");
+    } else if (bc_dict_get(&msg, "ops", &ops) == 0) {
+	bcmd_op(cf, controlfd, cmd, &msg, &o, dtime);
+    } else if (ops.type != BC_LIST) {
+	bcmd_error(&o, 0, "ops is not a list");
+    } else {
+	bc_raw(&o, "d7:resultsl", 11);
+	for (p = ops.s; bc_next(&ops, &p, &v) != 0;)
+	    bcmd_op(cf, controlfd, cmd, &v, &o, dtime);
+	bc_raw(&o, "ee", 2);
+    }
+    if (o.overflow != 0) {
+	rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "reply to structured command is too long");
+	o.len = o.overflow = 0;
+	bcmd_error(&o, 7, "reply is too long");
+    }
+    reply_buf(&cf->stable, controlfd, cmd, buf, o.len);
+    return 0;
+}
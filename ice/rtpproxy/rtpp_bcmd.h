@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RTPP_BCMD_H_
+#define _RTPP_BCMD_H_
+
+/*
+ * Structured control protocol. Instead of the text command, the client
+ * may send bencoded dictionary (after the cookie in the UDP mode), which
+ * is recognized by the leading "d" followed by a digit. The dictionary
+ * either describes a single operation or carries list of them under the
+ * "ops" key, in which case the reply carries list of results in the same
+ * order under the "results" key. Each operation is named by the "op" key
+ * and takes named parameters, for example:
+ *
+ *   d2:op6:update7:call-id3:abc9:remote-ip9:127.0.0.111:remote-porti3000e
+ *     8:from-tag2:ft6:codecs3:0,8e
+ *
+ * Each result has "result" set to "ok" or "error", errors carry legacy
+ * error code in "error-code". Support for the protocol is reported by
+ * the VF command as 20261024.
+ */
+
+struct cfg;
+struct rtpp_command;
+
+int rtpp_bcmd_call_id(const struct rtpp_command *, const char **, int *);
+int rtpp_bcmd_handle(struct cfg *, int, struct rtpp_command *, double);
+
+#endif
@@ -26,6 +26,11 @@
  *
  */
 
+#if defined(__linux__)
+/* recvmmsg(2), sendmmsg(2) */
+#define	_GNU_SOURCE
+#endif
+
 #include "config.h"
 
 #include <sys/types.h>
@@ -41,6 +46,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdio.h>
@@ -48,13 +54,27 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "rtp_codec.h"
+#include "rtp_dtmf.h"
+#include "rtp_prompt.h"
+#include "rtpp_bcmd.h"
 #include "rtpp_command.h"
+#include "rtpp_fork.h"
 #include "rtpp_log.h"
+#include "rtpp_preroll.h"
+#include "rtpp_rcache.h"
 #include "rtpp_notify.h"
 #include "rtpp_record.h"
 #include "rtpp_session.h"
 #include "rtpp_util.h"
 
+/* Codecs from the play command list the prompt is looked up in */
+#define	RTPP_PLAY_MAXCODECS	16
+
+/* Waiting for congested control socket before dropping a reply */
+#define	RTPP_REPLY_TRIES	3
+#define	RTPP_REPLY_WAIT		10	/* ms */
+
 struct proto_cap proto_caps[] = {
     /*
      * The first entry must be basic protocol version and isn't shown
@@ -69,6 +89,13 @@ struct proto_cap proto_caps[] = {
     { "20081102", "Support for setting codecs in the update/lookup command" },
     { "20081224", "Support for session timeout notifications" },
     { "20090810", "Support for automatic bridging" },
+    { "20261018", "Support for G.711 transcoding in the update/lookup command" },
+    { "20261019", "Support for G.711 conference mixing" },
+    { "20261020", "Support for DTMF reporting via notification socket" },
+    { "20261021", "Support for setting packetization time in the play command" },
+    { "20261022", "Support for forking stream to multiple destinations" },
+    { "20261023", "Support for persistent stream control connections" },
+    { "20261024", "Support for structured (bencode) commands" },
     { NULL, NULL }
 };
 
@@ -76,7 +103,10 @@ static int create_twinlistener(struct cfg_stable *, struct sockaddr *, int, int
 static int create_listener(struct cfg *, struct sockaddr *, int *, int *);
 static int handle_delete(struct cfg *, char *, char *, char *, int);
 static void handle_noplay(struct cfg *, struct rtpp_session *, int);
-static int handle_play(struct cfg *, struct rtpp_session *, int, char *, char *, int);
+static int handle_mix(struct cfg *, struct rtpp_session *, int, char *);
+static int handle_fork(struct cfg *, struct rtpp_session *, int, char *);
+static int handle_play(struct cfg *, struct rtpp_session *, int, char *, char *, int, int, int);
+static struct rtp_prompt *prepare_play(struct cfg *, struct rtpp_session *, int, char *, char *);
 static void handle_copy(struct cfg *, struct rtpp_session *, int, char *);
 static int handle_record(struct cfg *, char *, char *, char *);
 static void handle_query(struct cfg *, int, struct rtpp_command *,
@@ -129,6 +159,11 @@ failure:
     return rval;
 }
 
+/*
+ * Allocate a pair of ports and bind sockets to them. Doesn't need the
+ * glock, each port tried is claimed under the port lock, so that
+ * concurrent callers don't try the same ports.
+ */
 static int
 create_listener(struct cfg *cf, struct sockaddr *ia, int *port, int *fds)
 {
@@ -138,31 +173,86 @@ create_listener(struct cfg *cf, struct sockaddr *ia, int *port, int *fds)
 	fds[i] = -1;
 
     for (i = 1; i < cf->stable.port_table_len; i++) {
-	idx = (cf->port_table_idx + i) % cf->stable.port_table_len;
+	pthread_mutex_lock(&cf->port_lock);
+	idx = (cf->port_table_idx + 1) % cf->stable.port_table_len;
+	cf->port_table_idx = idx;
+	pthread_mutex_unlock(&cf->port_lock);
 	*port = cf->stable.port_table[idx];
 	rval = create_twinlistener(&(cf->stable), ia, *port, fds);
-	if (rval == 0) {
-	    cf->port_table_idx = idx;
+	if (rval == 0)
 	    return 0;
-	}
 	if (rval == -1)
 	    break;
     }
     return -1;
 }
 
+/*
+ * Wait for the control socket to accept data again after ENOBUFS. Gives
+ * up after few attempts, so that the caller never spins on a congested
+ * socket; the reply is dropped then and left to the client to retransmit.
+ */
+static int
+reply_wait(int fd, int *triesp)
+{
+    struct pollfd pfd;
+
+    if (++(*triesp) > RTPP_REPLY_TRIES)
+	return -1;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, RTPP_REPLY_WAIT) <= 0)
+	return -1;
+    return 0;
+}
+
 static void
-doreply(struct cfg_stable *cf, int fd, char *buf, int len,
+reply_send(struct cfg_stable *cf, int fd, const char *buf, int len,
   struct sockaddr_storage *raddr, socklen_t rlen)
 {
+    int tries;
+
+    tries = 0;
+    while (sendto(fd, buf, len, 0, sstosa(raddr), rlen) == -1) {
+	if (errno != ENOBUFS)
+	    return;
+	if (reply_wait(fd, &tries) != 0) {
+	    rtpp_log_write(RTPP_LOG_ERR, cf->glog,
+	      "control socket is congested, reply dropped");
+	    return;
+	}
+    }
+}
+
+static void
+doreply(struct cfg_stable *cf, int fd, struct rtpp_command *cmd, char *buf,
+  int len)
+{
 
     buf[len] = '\0';
+    if (cmd->rcap != NULL) {
+	if (len > cmd->rcap_size - 1 - cmd->rcap_len)
+	    len = cmd->rcap_size - 1 - cmd->rcap_len;
+	memcpy(cmd->rcap + cmd->rcap_len, buf, len);
+	cmd->rcap_len += len;
+	cmd->rcap[cmd->rcap_len] = '\0';
+	return;
+    }
     rtpp_log_write(RTPP_LOG_DBUG, cf->glog, "sending reply \"%s\"", buf);
     if (cf->umode == 0) {
 	write(fd, buf, len);
+	return;
+    }
+    if (cf->rcache != NULL && cmd->cookie != NULL)
+	rtpp_rcache_store(cf->rcache, sstosa(&cmd->raddr), cmd->rlen,
+	  cmd->cookie, buf, len);
+    if (cmd->rdefer != 0 && cmd->rbuf_len == 0 &&
+      len <= (int)sizeof(cmd->rbuf)) {
+	memcpy(cmd->rbuf, buf, len);
+	cmd->rbuf_len = len;
     } else {
-	while (sendto(fd, buf, len, 0, sstosa(raddr),
-	  rlen) == -1 && errno == ENOBUFS);
+	reply_send(cf, fd, buf, len, &cmd->raddr, cmd->rlen);
     }
 }
 
@@ -178,7 +268,7 @@ reply_number(struct cfg_stable *cf, int fd, struct rtpp_command *cmd,
     else {
 	len = sprintf(buf, "%d\n", number);
     }
-    doreply(cf, fd, buf, len, &cmd->raddr, cmd->rlen);
+    doreply(cf, fd, cmd, buf, len);
 }
 
 static void
@@ -208,7 +298,7 @@ reply_port(struct cfg_stable *cf, int fd, struct rtpp_command *cmd,
 	len += sprintf(cp, "%d %s%s\n", lport, /*roger addr2char(lia[0]),*/cf->advertised,
 	  (lia[0]->sa_family == AF_INET) ? "" : " 6");
     }
-    doreply(cf, fd, buf, len, &cmd->raddr, cmd->rlen);
+    doreply(cf, fd, cmd, buf, len);
 }
 
 static void
@@ -222,7 +312,26 @@ reply_error(struct cfg_stable *cf, int fd, struct rtpp_command *cmd,
 	len = sprintf(buf, "%s E%d\n", cmd->cookie, ecode);
     else
 	len = sprintf(buf, "E%d\n", ecode);
-    doreply(cf, fd, buf, len, &cmd->raddr, cmd->rlen);
+    doreply(cf, fd, cmd, buf, len);
+}
+
+/* Send reply prepared by the caller, prefixed with the cookie if any */
+void
+reply_buf(struct cfg_stable *cf, int fd, struct rtpp_command *cmd,
+  const char *data, int dlen)
+{
+    int len;
+    char buf[1024 * 8 + 128];
+
+    len = 0;
+    if (cmd->cookie != NULL)
+	len = snprintf(buf, sizeof(buf) - 2, "%s ", cmd->cookie);
+    if (dlen > (int)sizeof(buf) - 2 - len)
+	dlen = sizeof(buf) - 2 - len;
+    memcpy(buf + len, data, dlen);
+    len += dlen;
+    buf[len++] = '\n';
+    doreply(cf, fd, cmd, buf, len);
 }
 
 static void
@@ -249,43 +358,57 @@ handle_nomem(struct cfg_stable *cf, int fd, struct rtpp_command *cmd,
     reply_error(cf, fd, cmd, ecode);
 }
 
+/*
+ * Split command read into cmd->buf into arguments, 0 is returned if it's
+ * malformed. Reply capture in cmd->rcap is set up by the caller, since
+ * the error reply to a malformed command is produced here already.
+ */
 int
-get_command(struct cfg_stable *cfs, int controlfd, struct rtpp_command *cmd)
+parse_command(struct cfg_stable *cfs, int controlfd, struct rtpp_command *cmd,
+  int len)
 {
     char **ap;
-    char *cp;
-    int len, i;
+    char *cp, *bp;
+    int i;
 
-    if (cfs->umode == 0) {
-        for (;;) {
-            len = read(controlfd, cmd->buf, sizeof(cmd->buf) - 1);
-            if (len != -1 || (errno != EAGAIN && errno != EINTR))
-                break;
-            sched_yield();
-        }
-    } else {
-        cmd->rlen = sizeof(cmd->raddr);
-        len = recvfrom(controlfd, cmd->buf, sizeof(cmd->buf) - 1, 0,
-          sstosa(&cmd->raddr), &cmd->rlen);
-    }
-    if (len == -1) {
-        if (errno != EAGAIN && errno != EINTR)
-            rtpp_log_ewrite(RTPP_LOG_ERR, cfs->glog, "can't read from control socket");
-        return (-1);
-    }
     cmd->buf[len] = '\0';
+    cmd->rdefer = 0;
+    cmd->rbuf_len = 0;
+    cmd->can_persist = 0;
+    cmd->persist = 0;
+    cmd->bmsg = NULL;
 
     rtpp_log_write(RTPP_LOG_DBUG, cfs->glog, "received command \"%s\"", cmd->buf);
 
     cp = cmd->buf;
     cmd->argc = 0;
     memset(cmd->argv, 0, sizeof(cmd->argv));
-    for (ap = cmd->argv; (*ap = rtpp_strsep(&cp, "\r\n\t ")) != NULL;)
-        if (**ap != '\0') {
-            cmd->argc++;
-            if (++ap >= &cmd->argv[10])
-                break;
+
+    /*
+     * Structured command is parsed in place later, only the cookie is
+     * split off here.
+     */
+    bp = cp;
+    if (cfs->umode != 0) {
+        bp += strcspn(bp, "\r\n\t ");
+        bp += strspn(bp, "\r\n\t ");
+    }
+    if (bp[0] == 'd' && isdigit((unsigned char)bp[1])) {
+        cmd->bmsg = bp;
+        cmd->bmsg_len = cmd->buf + len - bp;
+        if (cfs->umode != 0) {
+            cp[strcspn(cp, "\r\n\t ")] = '\0';
+            cmd->argv[cmd->argc++] = cp;
         }
+        cmd->argv[cmd->argc++] = bp;
+    } else {
+        for (ap = cmd->argv; (*ap = rtpp_strsep(&cp, "\r\n\t ")) != NULL;)
+            if (**ap != '\0') {
+                cmd->argc++;
+                if (++ap >= &cmd->argv[10])
+                    break;
+            }
+    }
     cmd->cookie = NULL;
     if (cmd->argc < 1 || (cfs->umode != 0 && cmd->argc < 2)) {
         rtpp_log_write(RTPP_LOG_ERR, cfs->glog, "command syntax error");
@@ -296,6 +419,27 @@ get_command(struct cfg_stable *cfs, int controlfd, struct rtpp_command *cmd)
     /* Stream communication mode doesn't use cookie */
     if (cfs->umode != 0) {
         cmd->cookie = cmd->argv[0];
+        /* Answer retransmits without handling the command again */
+        if (cfs->rcache != NULL) {
+            switch (rtpp_rcache_check(cfs->rcache, sstosa(&cmd->raddr),
+              cmd->rlen, cmd->cookie, cmd->rbuf, &cmd->rbuf_len)) {
+            case RTPP_RCACHE_HIT:
+                rtpp_log_write(RTPP_LOG_DBUG, cfs->glog,
+                  "command retransmitted, sending cached reply");
+                reply_send(cfs, controlfd, cmd->rbuf, cmd->rbuf_len,
+                  &cmd->raddr, cmd->rlen);
+                cmd->rbuf_len = 0;
+                return (0);
+
+            case RTPP_RCACHE_PENDING:
+                rtpp_log_write(RTPP_LOG_DBUG, cfs->glog,
+                  "command retransmitted while being handled, ignoring");
+                return (0);
+
+            default:
+                break;
+            }
+        }
         for (i = 1; i < cmd->argc; i++)
             cmd->argv[i - 1] = cmd->argv[i];
         cmd->argc--;
@@ -306,6 +450,139 @@ get_command(struct cfg_stable *cfs, int controlfd, struct rtpp_command *cmd)
     return (cmd->argc);
 }
 
+int
+get_command(struct cfg_stable *cfs, int controlfd, struct rtpp_command *cmd)
+{
+    int len;
+
+    if (cfs->umode == 0) {
+        for (;;) {
+            len = read(controlfd, cmd->buf, sizeof(cmd->buf) - 1);
+            if (len != -1 || (errno != EAGAIN && errno != EINTR))
+                break;
+            sched_yield();
+        }
+    } else {
+        cmd->rlen = sizeof(cmd->raddr);
+        len = recvfrom(controlfd, cmd->buf, sizeof(cmd->buf) - 1, 0,
+          sstosa(&cmd->raddr), &cmd->rlen);
+    }
+    if (len == -1) {
+        if (errno != EAGAIN && errno != EINTR)
+            rtpp_log_ewrite(RTPP_LOG_ERR, cfs->glog, "can't read from control socket");
+        return (-1);
+    }
+    cmd->rcap = NULL;
+    return (parse_command(cfs, controlfd, cmd, len));
+}
+
+/*
+ * Receive up to ncmds commands from the UDP control socket at once and
+ * return number of commands received, argc of the malformed ones is
+ * set to 0. Replies to the commands are deferred until send_replies().
+ */
+int
+get_commands(struct cfg_stable *cfs, int controlfd, struct rtpp_command **cmds,
+  int ncmds)
+{
+#if defined(MSG_WAITFORONE)
+    struct mmsghdr msgs[RTPP_CMD_BATCH];
+    struct iovec iovs[RTPP_CMD_BATCH];
+    int i, n;
+
+    if (ncmds > RTPP_CMD_BATCH)
+        ncmds = RTPP_CMD_BATCH;
+    memset(msgs, 0, ncmds * sizeof(msgs[0]));
+    for (i = 0; i < ncmds; i++) {
+        iovs[i].iov_base = cmds[i]->buf;
+        iovs[i].iov_len = sizeof(cmds[i]->buf) - 1;
+        msgs[i].msg_hdr.msg_name = &cmds[i]->raddr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(cmds[i]->raddr);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(controlfd, msgs, ncmds, MSG_DONTWAIT, NULL);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EINTR)
+            rtpp_log_ewrite(RTPP_LOG_ERR, cfs->glog, "can't read from control socket");
+        return (-1);
+    }
+    for (i = 0; i < n; i++) {
+        cmds[i]->rlen = msgs[i].msg_hdr.msg_namelen;
+        cmds[i]->rcap = NULL;
+        if (parse_command(cfs, controlfd, cmds[i], msgs[i].msg_len) <= 0)
+            cmds[i]->argc = 0;
+        cmds[i]->rdefer = 1;
+    }
+    return (n);
+#else
+    int n;
+
+    n = get_command(cfs, controlfd, cmds[0]);
+    if (n == -1)
+        return (-1);
+    if (n == 0)
+        cmds[0]->argc = 0;
+    cmds[0]->rdefer = 1;
+    return (1);
+#endif
+}
+
+/* Send replies deferred while handling commands received by get_commands() */
+void
+send_replies(struct cfg_stable *cfs, int controlfd, struct rtpp_command **cmds,
+  int ncmds)
+{
+#if defined(MSG_WAITFORONE)
+    struct mmsghdr msgs[RTPP_CMD_BATCH];
+    struct iovec iovs[RTPP_CMD_BATCH];
+    int i, j, n, tries;
+
+    memset(msgs, 0, ncmds * sizeof(msgs[0]));
+    for (i = j = 0; i < ncmds; i++) {
+        if (cmds[i]->rbuf_len == 0)
+            continue;
+        iovs[j].iov_base = cmds[i]->rbuf;
+        iovs[j].iov_len = cmds[i]->rbuf_len;
+        msgs[j].msg_hdr.msg_name = &cmds[i]->raddr;
+        msgs[j].msg_hdr.msg_namelen = cmds[i]->rlen;
+        msgs[j].msg_hdr.msg_iov = &iovs[j];
+        msgs[j].msg_hdr.msg_iovlen = 1;
+        cmds[i]->rbuf_len = 0;
+        j++;
+    }
+    tries = 0;
+    for (i = 0; i < j; i += n) {
+        n = sendmmsg(controlfd, &msgs[i], j - i, 0);
+        if (n > 0) {
+            tries = 0;
+            continue;
+        }
+        if (n == -1 && errno == ENOBUFS) {
+            if (reply_wait(controlfd, &tries) == 0) {
+                n = 0;
+                continue;
+            }
+            rtpp_log_write(RTPP_LOG_ERR, cfs->glog,
+              "control socket is congested, reply dropped");
+            tries = 0;
+        }
+        /* Skip reply that has caused an error */
+        n = 1;
+    }
+#else
+    int i;
+
+    for (i = 0; i < ncmds; i++) {
+        if (cmds[i]->rbuf_len == 0)
+            continue;
+        reply_send(cfs, controlfd, cmds[i]->rbuf, cmds[i]->rbuf_len,
+          &cmds[i]->raddr, cmds[i]->rlen);
+        cmds[i]->rbuf_len = 0;
+    }
+#endif
+}
+
 int
 handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double dtime)
 {
@@ -313,27 +590,38 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
     int external, pf, lidx, playcount, weak, tpf;
     int fds[2], lport, n;
     char *cp, *call_id, *from_tag, *to_tag, *addr, *port;
-    char *pname, *codecs, *recording_name, *t;
+    char *pname, *codecs, *recording_name, *conf_name, *t;
     struct rtpp_session *spa, *spb;
     const char *rname, *errmsg;
     struct sockaddr *ia[2], *lia[2];
-    int requested_nsamples;
-    enum {DELETE, RECORD, PLAY, NOPLAY, COPY, UPDATE, LOOKUP, QUERY} op;
+    int requested_ptime, bcast;
+    const struct rtp_codec *xcode;
+    int dtmf;
+    enum {DELETE, RECORD, PLAY, NOPLAY, COPY, UPDATE, LOOKUP, QUERY, MIX, FORK} op;
     int max_argc;
     char *socket_name_u, *notify_tag;
-    struct sockaddr *local_addr;
+    struct sockaddr *local_addr, *laddr;
+    struct rtp_codec_map *rtpmap;
+    struct rtp_prompt *prompt;
     char c;
 
-    requested_nsamples = -1;
+    requested_ptime = -1;
+    bcast = 0;
     ia[0] = ia[1] = NULL;
     spa = spb = NULL;
     lia[0] = lia[1] = cf->stable.bindaddr[0];
     lidx = 1;
     fds[0] = fds[1] = -1;
-    recording_name = NULL;
+    recording_name = conf_name = NULL;
     socket_name_u = notify_tag = NULL;
     local_addr = NULL;
     codecs = NULL;
+    rtpmap = NULL;
+    xcode = NULL;
+    dtmf = 0;
+
+    if (cmd->bmsg != NULL)
+	return (rtpp_bcmd_handle(cf, controlfd, cmd, dtime));
 
     addr = port = NULL;
     switch (cmd->argv[0][0]) {
@@ -390,6 +678,33 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 	rname = "noplay";
 	break;
 
+    case 'm':
+    case 'M':
+	/*
+	 * M callid conf_name from_tag to_tag
+	 *
+	 *   Join the stream into conference <conf_name>, creating it if
+	 *   necessary. Name "-" (without quotes) makes the stream leave
+	 *   conference it is in.
+	 */
+	op = MIX;
+	rname = "mix";
+	break;
+
+    case 'f':
+    case 'F':
+	/*
+	 * F callid [-]host:port from_tag to_tag
+	 *
+	 *   Send copy of the stream to the host:port (RTCP to port + 1) in
+	 *   addition to any other destinations added before, or stop doing
+	 *   that if the address is prefixed with "-". Bare "-" (without
+	 *   quotes) removes all destinations.
+	 */
+	op = FORK;
+	rname = "fork";
+	break;
+
     case 'v':
     case 'V':
 	if (cmd->argv[0][1] == 'F' || cmd->argv[0][1] == 'f') {
@@ -412,6 +727,15 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 		reply_number(&cf->stable, controlfd, cmd, 0);
 		return 0;
 	    }
+	    /*
+	     * Asking for 20261023 over the stream connection keeps it
+	     * open for more commands, if that's possible.
+	     */
+	    if (strcmp(cmd->argv[1], "20261023") == 0) {
+		cmd->persist = cmd->can_persist;
+		reply_number(&cf->stable, controlfd, cmd, cmd->persist);
+		return 0;
+	    }
 	    for (known = i = 0; proto_caps[i].pc_id != NULL; ++i) {
 		if (!strcmp(cmd->argv[1], proto_caps[i].pc_id)) {
 		    known = 1;
@@ -477,8 +801,36 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 	}
 	from_tag = cmd->argv[4];
 	to_tag = cmd->argv[5];
-	if (op == PLAY && cmd->argv[0][1] != '\0')
-	    playcount = atoi(cmd->argv[0] + 1);
+	if (op == PLAY && cmd->argv[0][1] != '\0') {
+	    /* P[playcount][z<ptime>][b] */
+	    cp = cmd->argv[0] + 1;
+	    if (isdigit(*cp) || *cp == '-')
+		playcount = strtol(cp, &cp, 10);
+	    for (; *cp != '\0'; cp++) {
+		switch (*cp) {
+		case 'z':
+		case 'Z':
+		    requested_ptime = strtol(cp + 1, &cp, 10);
+		    if (requested_ptime <= 0) {
+			rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "command syntax error");
+			reply_error(&cf->stable, controlfd, cmd, 4);
+			return 0;
+		    }
+		    cp--;
+		    break;
+
+		case 'b':
+		case 'B':
+		    bcast = 1;
+		    break;
+
+		default:
+		    rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "command syntax error");
+		    reply_error(&cf->stable, controlfd, cmd, 4);
+		    return 0;
+		}
+	    }
+	}
 	if (op == UPDATE && cmd->argc > 6) {
 	    socket_name_u = cmd->argv[6];
 	    if (strncmp("unix:", socket_name_u, 5) == 0)
@@ -496,13 +848,16 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 	    }
 	}
     }
-    if (op == COPY) {
+    if (op == COPY || op == MIX || op == FORK) {
 	if (cmd->argc < 4 || cmd->argc > 5) {
 	    rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "command syntax error");
 	    reply_error(&cf->stable, controlfd, cmd, 1);
 	    return 0;
 	}
-	recording_name = cmd->argv[2];
+	if (op == MIX)
+	    conf_name = cmd->argv[2];
+	else
+	    recording_name = cmd->argv[2];
 	from_tag = cmd->argv[3];
 	to_tag = cmd->argv[4];
     }
@@ -515,8 +870,9 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 	from_tag = cmd->argv[2];
 	to_tag = cmd->argv[3];
     }
-    if (op == DELETE || op == RECORD || op == COPY || op == NOPLAY) {
-	/* D, R and S commands don't take any modifiers */
+    if (op == DELETE || op == RECORD || op == COPY || op == NOPLAY || op == MIX ||
+      op == FORK) {
+	/* D, R, S, M and F commands don't take any modifiers */
 	if (cmd->argv[0][1] != '\0') {
 	    rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "command syntax error");
 	    reply_error(&cf->stable, controlfd, cmd, 1);
@@ -577,8 +933,8 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 
 	    case 'z':
 	    case 'Z':
-		requested_nsamples = (strtol(cp + 1, &cp, 10) / 10) * 80;
-		if (requested_nsamples <= 0) {
+		requested_ptime = (strtol(cp + 1, &cp, 10) / 10) * 10;
+		if (requested_ptime <= 0) {
 		    rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "command syntax error");
 		    reply_error(&cf->stable, controlfd, cmd, 1);
 		    return 0;
@@ -586,21 +942,33 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 		cp--;
 		break;
 
+	    case 'd':
+	    case 'D':
+		dtmf = 1;
+		break;
+
+	    case 't':
+	    case 'T':
+		n = strtol(cp + 1, &t, 10);
+		if (t == cp + 1 || (n != RTP_PCMU && n != RTP_PCMA)) {
+		    rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "command syntax error");
+		    reply_error(&cf->stable, controlfd, cmd, 1);
+		    return 0;
+		}
+		xcode = rtp_codec_lookup(NULL, n)->codec;
+		cp = t - 1;
+		break;
+
 	    case 'c':
 	    case 'C':
 		cp += 1;
-		for (t = cp; *cp != '\0'; cp++) {
-		    if (!isdigit(*cp) && *cp != ',')
-			break;
-		}
-		if (t == cp) {
+		codecs = alloca(strlen(cp) + 1);
+		rtpmap = alloca(sizeof(*rtpmap));
+		if (rtp_codec_map_parse(cp, &cp, rtpmap, codecs) == -1) {
 		    rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "command syntax error");
 		    reply_error(&cf->stable, controlfd, cmd, 1);
 		    return 0;
 		}
-		codecs = alloca(cp - t + 1);
-		memcpy(codecs, t, cp - t);
-		codecs[cp - t] = '\0';
 		cp--;
 		break;
 
@@ -702,6 +1070,7 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
      * Record and delete need special handling since they apply to all
      * streams in the session.
      */
+lookup:
     switch (op) {
     case DELETE:
 	i = handle_delete(cf, call_id, from_tag, to_tag, weak);
@@ -745,15 +1114,43 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 	return 0;
 
     case PLAY:
-	handle_noplay(cf, spa, i);
 	if (strcmp(codecs, "session") == 0) {
 	    if (spa->codecs[i] == NULL) {
+		handle_noplay(cf, spa, i);
 		reply_error(&cf->stable, controlfd, cmd, 6);
 		return 0;
 	    }
-	    codecs = spa->codecs[i];
+	    codecs = alloca(strlen(spa->codecs[i]) + 1);
+	    strcpy(codecs, spa->codecs[i]);
+	}
+	/* Use packetization negotiated for the leg unless requested explicitly */
+	if (requested_ptime <= 0)
+	    requested_ptime = spa->resizers[NOT(i)].output_ptime;
+	prompt = NULL;
+	if (playcount != 0) {
+	    /*
+	     * The prompt may have to be read and encoded first, which is
+	     * done without glock, so that the session has to be looked up
+	     * once again afterwards.
+	     */
+	    prompt = prepare_play(cf, spa, i, codecs, pname);
+	    i = find_stream(cf, call_id, from_tag, to_tag, &spa);
+	    if (i == -1) {
+		if (prompt != NULL)
+		    rtp_prompt_release(prompt);
+		reply_error(&cf->stable, controlfd, cmd, 8);
+		return 0;
+	    }
+	    i = NOT(i);
 	}
-	if (playcount != 0 && handle_play(cf, spa, i, codecs, pname, playcount) != 0) {
+	handle_noplay(cf, spa, i);
+	n = 0;
+	if (playcount != 0)
+	    n = handle_play(cf, spa, i, codecs, pname, playcount,
+	      requested_ptime, bcast);
+	if (prompt != NULL)
+	    rtp_prompt_release(prompt);
+	if (n != 0) {
 	    reply_error(&cf->stable, controlfd, cmd, 6);
 	    return 0;
 	}
@@ -765,6 +1162,22 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 	reply_ok(&cf->stable, controlfd, cmd);
 	return 0;
 
+    case MIX:
+	if (handle_mix(cf, spa, i, conf_name) != 0) {
+	    reply_error(&cf->stable, controlfd, cmd, 5);
+	    return 0;
+	}
+	reply_ok(&cf->stable, controlfd, cmd);
+	return 0;
+
+    case FORK:
+	if (handle_fork(cf, spa, i, recording_name) != 0) {
+	    reply_error(&cf->stable, controlfd, cmd, 5);
+	    return 0;
+	}
+	reply_ok(&cf->stable, controlfd, cmd);
+	return 0;
+
     case QUERY:
 	handle_query(cf, controlfd, cmd, spa, i);
 	return 0;
@@ -787,11 +1200,25 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 	    if (local_addr != NULL) {
 		spa->laddr[i] = local_addr;
 	    }
-	    if (create_listener(cf, spa->laddr[i], &lport, fds) == -1) {
-		rtpp_log_write(RTPP_LOG_ERR, spa->log, "can't create listener");
+	    /* Binding sockets doesn't need the glock */
+	    laddr = spa->laddr[i];
+	    pthread_mutex_unlock(&cf->glock);
+	    n = create_listener(cf, laddr, &lport, fds);
+	    pthread_mutex_lock(&cf->glock);
+	    if (n == -1) {
+		rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "can't create listener");
 		reply_error(&cf->stable, controlfd, cmd, 7);
 		return 0;
 	    }
+	    /* Session may have changed or gone meanwhile, start over if so */
+	    i = find_stream(cf, call_id, from_tag, to_tag, &spa);
+	    if (i != -1 && op != UPDATE)
+		i = NOT(i);
+	    if (i == -1 || spa->fds[i] != -1) {
+		close(fds[0]);
+		close(fds[1]);
+		goto lookup;
+	    }
 	    assert(spa->fds[i] == -1);
 	    spa->fds[i] = fds[0];
 	    assert(spa->rtcp->fds[i] == -1);
@@ -836,11 +1263,20 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 		return 0;
 	    }
 	}
-	if (create_listener(cf, lia[0], &lport, fds) == -1) {
+	pthread_mutex_unlock(&cf->glock);
+	n = create_listener(cf, lia[0], &lport, fds);
+	pthread_mutex_lock(&cf->glock);
+	if (n == -1) {
 	    rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog, "can't create listener");
 	    reply_error(&cf->stable, controlfd, cmd, 10);
 	    return 0;
 	}
+	/* Session may have been created meanwhile, start over if so */
+	if (find_stream(cf, call_id, from_tag, to_tag, &spa) != -1) {
+	    close(fds[0]);
+	    close(fds[1]);
+	    goto lookup;
+	}
 
 	/*
 	 * Session creation. If creation is requested with weak flag,
@@ -907,7 +1343,6 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
 	spb->rtcp = NULL;
 	spa->rtp = NULL;
 	spb->rtp = spa;
-	spa->sridx = spb->sridx = -1;
 
 	append_session(cf, spa, 0);
 	append_session(cf, spa, 1);
@@ -1014,16 +1449,50 @@ handle_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double d
     }
     if (codecs != NULL)
 	spa->codecs[pidx] = strdup(codecs);
-    if (requested_nsamples > 0) {
+    if (spa->rtpmap[pidx] != NULL) {
+	free(spa->rtpmap[pidx]);
+	spa->rtpmap[pidx] = NULL;
+    }
+    if (rtpmap != NULL) {
+	spa->rtpmap[pidx] = malloc(sizeof(*rtpmap));
+	if (spa->rtpmap[pidx] != NULL)
+	    memcpy(spa->rtpmap[pidx], rtpmap, sizeof(*rtpmap));
+    }
+    if (requested_ptime > 0) {
 	rtpp_log_write(RTPP_LOG_INFO, spa->log, "RTP packets from %s "
 	  "will be resized to %d milliseconds",
-	  (pidx == 0) ? "callee" : "caller", requested_nsamples / 8);
-    } else if (spa->resizers[pidx].output_nsamples > 0) {
+	  (pidx == 0) ? "callee" : "caller", requested_ptime);
+    } else if (is_rtp_resizer_enabled(spa->resizers[pidx])) {
 	  rtpp_log_write(RTPP_LOG_INFO, spa->log, "Resizing of RTP "
 	  "packets from %s has been disabled",
 	  (pidx == 0) ? "callee" : "caller");
     }
-    spa->resizers[pidx].output_nsamples = requested_nsamples;
+    spa->resizers[pidx].output_ptime = requested_ptime;
+    if (xcode != NULL) {
+	rtpp_log_write(RTPP_LOG_INFO, spa->log, "G.711 RTP packets to %s "
+	  "will be transcoded into %s", (pidx == 0) ? "callee" : "caller",
+	  xcode->name);
+    } else if (spa->xcode[pidx] != NULL) {
+	rtpp_log_write(RTPP_LOG_INFO, spa->log, "Transcoding of RTP "
+	  "packets to %s has been disabled", (pidx == 0) ? "callee" : "caller");
+    }
+    spa->xcode[pidx] = xcode;
+    if (dtmf != 0 && spa->dtmf[pidx] == NULL) {
+	spa->dtmf[pidx] = malloc(sizeof(*spa->dtmf[pidx]));
+	if (spa->dtmf[pidx] == NULL) {
+	    rtpp_log_write(RTPP_LOG_ERR, spa->log, "can't allocate memory "
+	      "for DTMF detector");
+	} else {
+	    rtp_dtmf_init(spa->dtmf[pidx]);
+	    rtpp_log_write(RTPP_LOG_INFO, spa->log, "DTMF digits from %s "
+	      "will be reported", (pidx == 0) ? "callee" : "caller");
+	}
+    } else if (dtmf == 0 && spa->dtmf[pidx] != NULL) {
+	free(spa->dtmf[pidx]);
+	spa->dtmf[pidx] = NULL;
+	rtpp_log_write(RTPP_LOG_INFO, spa->log, "Reporting of DTMF digits "
+	  "from %s has been disabled", (pidx == 0) ? "callee" : "caller");
+    }
 
     for (i = 0; i < 2; i++)
 	if (ia[i] != NULL)
@@ -1103,24 +1572,56 @@ handle_noplay(struct cfg *cf, struct rtpp_session *spa, int idx)
 {
 
     if (spa->rtps[idx] != NULL) {
-	rtp_server_free(spa->rtps[idx]);
-	spa->rtps[idx] = NULL;
+	rtp_server_unsubscribe(cf, spa->rtps[idx], spa, idx);
 	rtpp_log_write(RTPP_LOG_INFO, spa->log,
 	  "stopping player at port %d", spa->ports[idx]);
-	if (spa->rtps[0] == NULL && spa->rtps[1] == NULL) {
-	    assert(cf->rtp_servers[spa->sridx] == spa);
-	    cf->rtp_servers[spa->sridx] = NULL;
-	    spa->sridx = -1;
-	}
    }
 }
 
+/*
+ * Get the prompt for the first codec in the list it's available in, so
+ * that the player created afterwards finds it in the cache. Reading and
+ * encoding the prompt can take a while, hence it's done with glock
+ * released. Called with glock held, the session may be gone on return.
+ */
+static struct rtp_prompt *
+prepare_play(struct cfg *cf, struct rtpp_session *spa, int idx, char *codecs,
+  char *pname)
+{
+    const struct rtp_codec_ent *cent;
+    struct rtp_prompt *prompt;
+    int ids[RTPP_PLAY_MAXCODECS];
+    int n, k, nids;
+    char *cp;
+
+    nids = 0;
+    while (*codecs != '\0' && nids < RTPP_PLAY_MAXCODECS) {
+	n = strtol(codecs, &cp, 10);
+	if (cp == codecs)
+	    break;
+	codecs = cp;
+	if (*codecs != '\0')
+	    codecs++;
+	cent = rtp_codec_lookup(spa->rtpmap[idx], n);
+	if (cent != NULL)
+	    ids[nids++] = cent->codec->id;
+    }
+
+    pthread_mutex_unlock(&cf->glock);
+    prompt = NULL;
+    for (k = 0; k < nids && prompt == NULL; k++)
+	prompt = rtp_prompt_get_codec(pname, ids[k]);
+    pthread_mutex_lock(&cf->glock);
+    return prompt;
+}
+
 static int
 handle_play(struct cfg *cf, struct rtpp_session *spa, int idx, char *codecs,
-  char *pname, int playcount)
+  char *pname, int playcount, int ptime, int bcast)
 {
     int n;
     char *cp;
+    struct rtp_server *rp;
 
     while (*codecs != '\0') {
 	n = strtol(codecs, &cp, 10);
@@ -1129,19 +1630,142 @@ handle_play(struct cfg *cf, struct rtpp_session *spa, int idx, char *codecs,
 	codecs = cp;
 	if (*codecs != '\0')
 	    codecs++;
-	spa->rtps[idx] = rtp_server_new(pname, n, playcount);
-	if (spa->rtps[idx] == NULL)
+	if (n < 0 || n > 127) {
+	    rtpp_log_write(RTPP_LOG_ERR, spa->log,
+	      "invalid payload type %d in the codec list", n);
 	    continue;
-	rtpp_log_write(RTPP_LOG_INFO, spa->log,
-	  "%d times playing prompt %s codec %d", playcount, pname, n);
-	if (spa->sridx == -1)
-	    append_server(cf, spa);
+	}
+	if (bcast)
+	    rp = rtp_server_bcast(cf, pname, n, spa->rtpmap[idx], ptime);
+	else
+	    rp = rtp_server_new(pname, n, playcount, spa->rtpmap[idx], ptime);
+	if (rp == NULL)
+	    continue;
+	if (rtp_server_subscribe(cf, rp, spa, idx, n) != 0) {
+	    if (rp->nsubs == 0) {
+		if (rp->bcast)
+		    rtp_server_unsubscribe(cf, rp, spa, idx);
+		else
+		    rtp_server_free(rp);
+	    }
+	    break;
+	}
+	if (bcast) {
+	    rtpp_log_write(RTPP_LOG_INFO, spa->log,
+	      "listening to broadcast of prompt %s codec %d, %d ms per packet, "
+	      "%d listeners", pname, n, rp->rticks, rp->nsubs);
+	} else {
+	    rtpp_log_write(RTPP_LOG_INFO, spa->log,
+	      "%d times playing prompt %s codec %d, %d ms per packet",
+	      playcount, pname, n, rp->rticks);
+	}
 	return 0;
     }
     rtpp_log_write(RTPP_LOG_ERR, spa->log, "can't create player");
     return -1;
 }
 
+static int
+handle_mix(struct cfg *cf, struct rtpp_session *spa, int idx, char *conf_name)
+{
+
+    if (spa->rtpm[idx] != NULL) {
+	rtpp_log_write(RTPP_LOG_INFO, spa->log,
+	  "port %d leaves conference %s", spa->ports[idx],
+	  spa->rtpm[idx]->mixer->name);
+	rtp_mixer_leave(cf, spa->rtpm[idx]);
+	spa->rtpm[idx] = NULL;
+    }
+    if (strcmp(conf_name, "-") == 0)
+	return 0;
+    spa->rtpm[idx] = rtp_mixer_join(cf, conf_name, spa, idx);
+    if (spa->rtpm[idx] == NULL) {
+	rtpp_log_write(RTPP_LOG_ERR, spa->log, "can't join conference %s",
+	  conf_name);
+	return -1;
+    }
+    rtpp_log_write(RTPP_LOG_INFO, spa->log,
+      "port %d joins conference %s", spa->ports[idx], conf_name);
+    return 0;
+}
+
+/*
+ * Write out packets kept in the pre-roll buffer into the recording
+ * that has just been started, the buffer is not needed after that.
+ */
+static void
+flush_preroll(struct rtpp_session *sp, int idx)
+{
+
+    if (sp->rrcs[idx] == NULL || sp->preroll[idx] == NULL)
+	return;
+    rtpp_preroll_flush(sp->preroll[idx], sp, idx, sp->rrcs[idx]);
+    rtpp_preroll_free(sp->preroll[idx]);
+    sp->preroll[idx] = NULL;
+}
+
+static int
+handle_fork(struct cfg *cf, struct rtpp_session *spa, int idx, char *target)
+{
+    struct sockaddr_storage dst;
+    char *cp;
+    int n, port, del;
+
+    del = 0;
+    if (target[0] == '-') {
+	del = 1;
+	target++;
+	if (target[0] == '\0') {
+	    rtpp_fork_remove(&spa->forks[idx], NULL);
+	    rtpp_fork_remove(&spa->rtcp->forks[idx], NULL);
+	    rtpp_log_write(RTPP_LOG_INFO, spa->log,
+	      "stopped forking RTP session on port %d", spa->ports[idx]);
+	    return 0;
+	}
+    }
+    cp = strrchr(target, ':');
+    if (cp == NULL) {
+	rtpp_log_write(RTPP_LOG_ERR, spa->log, "fork destination should include port number");
+	return -1;
+    }
+    *cp = '\0';
+    cp++;
+    port = atoi(cp);
+    if (port <= 0 || port > 65534) {
+	rtpp_log_write(RTPP_LOG_ERR, spa->log, "invalid port in the fork destination");
+	return -1;
+    }
+    n = resolve(sstosa(&dst), AF_INET, target, cp, AI_NUMERICHOST);
+    if (n != 0) {
+	rtpp_log_write(RTPP_LOG_ERR, spa->log, "invalid fork destination: %s: %s",
+	  target, gai_strerror(n));
+	return -1;
+    }
+
+    if (del != 0) {
+	if (rtpp_fork_remove(&spa->forks[idx], sstosa(&dst)) != 0) {
+	    rtpp_log_write(RTPP_LOG_ERR, spa->log, "RTP session on port %d "
+	      "isn't forked to %s:%d", spa->ports[idx], target, port);
+	    return -1;
+	}
+	satosin(&dst)->sin_port = htons(port + 1);
+	rtpp_fork_remove(&spa->rtcp->forks[idx], sstosa(&dst));
+	rtpp_log_write(RTPP_LOG_INFO, spa->log, "stopped forking RTP session "
+	  "on port %d to %s:%d", spa->ports[idx], target, port);
+	return 0;
+    }
+
+    if (rtpp_fork_add(&spa->forks[idx], sstosa(&dst), spa->log) != 0)
+	return -1;
+    if (cf->stable.rrtcp != 0) {
+	satosin(&dst)->sin_port = htons(port + 1);
+	rtpp_fork_add(&spa->rtcp->forks[idx], sstosa(&dst), spa->log);
+    }
+    rtpp_log_write(RTPP_LOG_INFO, spa->log, "forking RTP session on port %d "
+      "to %s:%d", spa->ports[idx], target, port);
+    return 0;
+}
+
 static void
 handle_copy(struct cfg *cf, struct rtpp_session *spa, int idx, char *rname)
 {
@@ -1150,11 +1774,13 @@ handle_copy(struct cfg *cf, struct rtpp_session *spa, int idx, char *rname)
 	spa->rrcs[idx] = ropen(cf, spa, rname, idx);
 	rtpp_log_write(RTPP_LOG_INFO, spa->log,
 	  "starting recording RTP session on port %d", spa->ports[idx]);
+	flush_preroll(spa, idx);
     }
     if (spa->rtcp->rrcs[idx] == NULL && cf->stable.rrtcp != 0) {
 	spa->rtcp->rrcs[idx] = ropen(cf, spa->rtcp, rname, idx);
 	rtpp_log_write(RTPP_LOG_INFO, spa->log,
 	  "starting recording RTCP session on port %d", spa->rtcp->ports[idx]);
+	flush_preroll(spa->rtcp, idx);
     }
 }
 
@@ -1198,7 +1824,7 @@ handle_query(struct cfg *cf, int fd, struct rtpp_command *cmd,
 	  spa->pcount[idx], spa->pcount[NOT(idx)], spa->pcount[2],
 	  spa->pcount[3]);
     }
-    doreply(&cf->stable, fd, buf, len, &cmd->raddr, cmd->rlen);
+    doreply(&cf->stable, fd, cmd, buf, len);
 }
 
 static void
@@ -1256,11 +1882,11 @@ handle_info(struct cfg *cf, int fd, struct rtpp_command *cmd,
 	  addrs[2], spb->ports[0], addrs[3], spa->pcount[0], spa->pcount[1],
 	  spa->pcount[2], spa->pcount[3], spb->ttl[0], spb->ttl[1]);
 	if (len + 512 > sizeof(buf)) {
-	    doreply(&cf->stable, fd, buf, len, &cmd->raddr, cmd->rlen);
+	    doreply(&cf->stable, fd, cmd, buf, len);
 	    len = 0;
 	}
     }
     pthread_mutex_unlock(&cf->sessinfo.lock);
     if (len > 0)
-	doreply(&cf->stable, fd, buf, len, &cmd->raddr, cmd->rlen);
+	doreply(&cf->stable, fd, cmd, buf, len);
 }
@@ -36,6 +36,9 @@ struct proto_cap {
     const char  *pc_description;
 };
 
+/* Maximum number of commands received at once in the UDP mode */
+#define	RTPP_CMD_BATCH	32
+
 struct rtpp_command
 {
     char buf[1024 * 8];
@@ -44,11 +47,37 @@ struct rtpp_command
     struct sockaddr_storage raddr;
     socklen_t rlen;
     char *cookie;
+    /*
+     * If set, short reply is kept in rbuf and sent along with replies
+     * to other commands from the same batch by send_replies().
+     */
+    int rdefer;
+    char rbuf[256];
+    int rbuf_len;
+    /*
+     * In the stream mode can_persist is set if the connection can be
+     * kept open for more commands, persist is set by handle_command()
+     * once the client has asked for it.
+     */
+    int can_persist;
+    int persist;
+    /* Structured command, see rtpp_bcmd.h */
+    const char *bmsg;
+    int bmsg_len;
+    /* If set, replies are collected here instead of being sent */
+    char *rcap;
+    int rcap_size;
+    int rcap_len;
 };
 
 extern struct proto_cap proto_caps[];
 
 int handle_command(struct cfg *, int, struct rtpp_command *, double);
 int get_command(struct cfg_stable *, int, struct rtpp_command *);
+int parse_command(struct cfg_stable *, int, struct rtpp_command *, int);
+void reply_buf(struct cfg_stable *, int, struct rtpp_command *, const char *,
+  int);
+int get_commands(struct cfg_stable *, int, struct rtpp_command **, int);
+void send_replies(struct cfg_stable *, int, struct rtpp_command **, int);
 
 #endif
@@ -26,16 +26,329 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/un.h>
 
 #include "rtpp_defines.h"
+#include "rtpp_bcmd.h"
 #include "rtpp_command.h"
 #include "rtpp_network.h"
+#include "rtpp_rcache.h"
+#include "rtpp_session.h"
 #include "rtpp_util.h"
 
+/*
+ * With more than one command worker, commands are distributed between
+ * shards by the hash of the call-id, so that commands for the same call
+ * are always handled in order by the same worker, while commands for
+ * unrelated calls are handled in parallel. Each shard has its own queue
+ * protected by its own lock. Commands that don't refer to any call go
+ * to the first shard. Session table is still only updated with the glock
+ * held, but the slow parts of the commands, such as binding sockets for
+ * new sessions, reading prompts and sending replies, are done without
+ * it, so that they overlap between workers.
+ */
+#define	RTPP_CMD_QLEN	1024	/* Maximum number of commands queued per shard */
+
+struct rtpp_cmd_item {
+    struct rtpp_command cmd;
+    int controlfd;
+    double dtime;
+    struct rtpp_cmd_item *next;
+};
+
+struct rtpp_cmd_shard {
+    struct cfg *cf;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct rtpp_cmd_item *head, *tail;
+    int qlen;
+};
+
+/*
+ * Stream connections are closed after the first command, unless the
+ * client asks to keep the connection open with VF 20261023. Commands
+ * received over such connection afterwards are terminated by newlines,
+ * the client doesn't have to wait for replies before sending more
+ * commands. Commands are handled by the control thread itself in the
+ * order they have been received, so that replies come in the same order.
+ * Replies are queued per connection and written out as the socket accepts
+ * them, connection of the client that doesn't read its replies is closed
+ * once the queue is full.
+ */
+#define	RTPP_CMD_MAXCONNS	64
+#define	RTPP_CMD_OBUFSIZE	(32 * 1024)
+
+struct rtpp_cmd_conn {
+    int fd;
+    int len;
+    char buf[sizeof(((struct rtpp_command *)0)->buf)];
+    int olen;
+    char obuf[RTPP_CMD_OBUFSIZE];
+};
+
 static pthread_t rtpp_cmd_queue;
+static struct rtpp_cmd_shard *rtpp_cmd_shards;
+static struct rtpp_cmd_conn *rtpp_cmd_conns[RTPP_CMD_MAXCONNS];
+static int rtpp_cmd_nconns;
+
+static int
+run_command(struct cfg *cf, int controlfd, struct rtpp_command *cmd, double dtime)
+{
+    int i;
+
+    pthread_mutex_lock(&cf->glock);
+    i = handle_command(cf, controlfd, cmd, dtime);
+    pthread_mutex_unlock(&cf->glock);
+    return i;
+}
+
+static void
+rtpp_cmd_shard_run(void *arg)
+{
+    struct rtpp_cmd_shard *shard;
+    struct rtpp_cmd_item *item;
+    struct rtpp_command *cmd;
+
+    shard = (struct rtpp_cmd_shard *)arg;
+    for (;;) {
+        pthread_mutex_lock(&shard->lock);
+        while (shard->head == NULL)
+            pthread_cond_wait(&shard->cond, &shard->lock);
+        item = shard->head;
+        shard->head = item->next;
+        if (shard->head == NULL)
+            shard->tail = NULL;
+        shard->qlen--;
+        pthread_mutex_unlock(&shard->lock);
+
+        run_command(shard->cf, item->controlfd, &item->cmd, item->dtime);
+        if (shard->cf->stable.umode == 0) {
+            close(item->controlfd);
+        } else {
+            /* Reply has been deferred until the glock is released */
+            cmd = &item->cmd;
+            send_replies(&shard->cf->stable, item->controlfd, &cmd, 1);
+        }
+        free(item);
+    }
+}
+
+/* Pass command over to the worker of the shard owning the call */
+static void
+dispatch_command(struct cfg *cf, struct rtpp_cmd_item *item)
+{
+    struct rtpp_cmd_shard *shard;
+    const char *call_id;
+    int idx, len;
+
+    idx = 0;
+    if (item->cmd.bmsg != NULL) {
+        if (rtpp_bcmd_call_id(&item->cmd, &call_id, &len) != 0)
+            idx = hash_string(&cf->stable, call_id, call_id + len) %
+              cf->stable.cmd_workers;
+    } else if (item->cmd.argc > 1) {
+        idx = hash_string(&cf->stable, item->cmd.argv[1], NULL) %
+          cf->stable.cmd_workers;
+    }
+    shard = &rtpp_cmd_shards[idx];
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->qlen >= RTPP_CMD_QLEN) {
+        pthread_mutex_unlock(&shard->lock);
+        rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog,
+          "command queue of worker %d is full, dropping command", idx);
+        if (cf->stable.umode == 0) {
+            close(item->controlfd);
+        } else if (cf->stable.rcache != NULL) {
+            /* Let retransmit of the command through */
+            rtpp_rcache_store(cf->stable.rcache, sstosa(&item->cmd.raddr),
+              item->cmd.rlen, item->cmd.cookie, NULL, 0);
+        }
+        free(item);
+        return;
+    }
+    item->next = NULL;
+    if (shard->tail == NULL)
+        shard->head = item;
+    else
+        shard->tail->next = item;
+    shard->tail = item;
+    shard->qlen++;
+    pthread_cond_signal(&shard->cond);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * In the UDP mode commands are received in batches. Without workers all
+ * commands of the batch are handled first and then replies to them are
+ * sent at once, otherwise commands are dispatched to workers, which
+ * reply to each one once it's handled and the glock is released.
+ */
+static void
+process_commands_udp(struct cfg *cf, int controlfd, double dtime)
+{
+    static struct rtpp_cmd_item *items[RTPP_CMD_BATCH];
+    struct rtpp_command *cmds[RTPP_CMD_BATCH];
+    int i, n, nitems;
+
+    for (;;) {
+        for (nitems = 0; nitems < RTPP_CMD_BATCH; nitems++) {
+            if (items[nitems] == NULL)
+                items[nitems] = malloc(sizeof(*items[nitems]));
+            if (items[nitems] == NULL)
+                break;
+            cmds[nitems] = &items[nitems]->cmd;
+        }
+        if (nitems == 0) {
+            rtpp_log_ewrite(RTPP_LOG_ERR, cf->stable.glog,
+              "can't allocate memory");
+            break;
+        }
+        n = get_commands(&cf->stable, controlfd, cmds, nitems);
+        if (n <= 0)
+            break;
+        if (cf->stable.cmd_workers <= 1) {
+            for (i = 0; i < n; i++) {
+                if (cmds[i]->argc > 0)
+                    run_command(cf, controlfd, cmds[i], dtime);
+            }
+            send_replies(&cf->stable, controlfd, cmds, n);
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            if (cmds[i]->argc == 0)
+                continue;
+            items[i]->controlfd = controlfd;
+            items[i]->dtime = dtime;
+            dispatch_command(cf, items[i]);
+            items[i] = NULL;
+        }
+    }
+}
+
+static int
+conn_add(struct cfg *cf, int fd)
+{
+    struct rtpp_cmd_conn *conn;
+    int flags;
+
+    conn = malloc(sizeof(*conn));
+    if (conn == NULL) {
+        rtpp_log_ewrite(RTPP_LOG_ERR, cf->stable.glog, "can't allocate memory");
+        return -1;
+    }
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    conn->fd = fd;
+    conn->len = 0;
+    conn->olen = 0;
+    rtpp_cmd_conns[rtpp_cmd_nconns++] = conn;
+    return 0;
+}
+
+static void
+conn_remove(int idx)
+{
+
+    close(rtpp_cmd_conns[idx]->fd);
+    free(rtpp_cmd_conns[idx]);
+    rtpp_cmd_nconns--;
+    rtpp_cmd_conns[idx] = rtpp_cmd_conns[rtpp_cmd_nconns];
+    rtpp_cmd_conns[rtpp_cmd_nconns] = NULL;
+}
+
+/* Write out as much of the queued replies as the socket accepts */
+static int
+conn_flush(struct rtpp_cmd_conn *conn)
+{
+    int n;
+
+    if (conn->olen == 0)
+        return 0;
+    n = write(conn->fd, conn->obuf, conn->olen);
+    if (n == -1)
+        return ((errno == EAGAIN || errno == EINTR) ? 0 : -1);
+    conn->olen -= n;
+    memmove(conn->obuf, conn->obuf + n, conn->olen);
+    return 0;
+}
+
+/*
+ * Write out queued replies once the persistent connection is writable,
+ * read from it and handle complete commands.
+ */
+static void
+process_conn(struct cfg *cf, int idx, int revents, double dtime)
+{
+    struct rtpp_cmd_conn *conn;
+    struct rtpp_command cmd;
+    char *cp;
+    int len, n;
+
+    conn = rtpp_cmd_conns[idx];
+    if ((revents & POLLOUT) != 0 && conn_flush(conn) != 0) {
+        rtpp_log_ewrite(RTPP_LOG_ERR, cf->stable.glog,
+          "can't write to control connection");
+        conn_remove(idx);
+        return;
+    }
+    if ((revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+        return;
+    n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - 1 - conn->len);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        if (n == -1)
+            rtpp_log_ewrite(RTPP_LOG_ERR, cf->stable.glog,
+              "can't read from control connection");
+        conn_remove(idx);
+        return;
+    }
+    conn->len += n;
+
+    while ((cp = memchr(conn->buf, '\n', conn->len)) != NULL) {
+        len = cp - conn->buf;
+        if (len > 0 && conn->buf[len - 1] == '\r')
+            len--;
+        if (len > 0) {
+            memcpy(cmd.buf, conn->buf, len);
+            /* Reply, including the error one, goes to the end of the queue */
+            cmd.rcap = conn->obuf + conn->olen;
+            cmd.rcap_size = sizeof(conn->obuf) - conn->olen;
+            cmd.rcap_len = 0;
+            if (parse_command(&cf->stable, conn->fd, &cmd, len) > 0) {
+                cmd.can_persist = 1;
+                run_command(cf, conn->fd, &cmd, dtime);
+            }
+            if (cmd.rcap_len >= cmd.rcap_size - 1) {
+                rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog,
+                  "replies to control connection aren't read, closing it");
+                conn_remove(idx);
+                return;
+            }
+            conn->olen += cmd.rcap_len;
+        }
+        conn->len -= cp + 1 - conn->buf;
+        memmove(conn->buf, cp + 1, conn->len);
+    }
+    if (conn->len == sizeof(conn->buf) - 1) {
+        rtpp_log_write(RTPP_LOG_ERR, cf->stable.glog,
+          "command received over control connection is too long");
+        conn_remove(idx);
+        return;
+    }
+    if (conn_flush(conn) != 0) {
+        rtpp_log_ewrite(RTPP_LOG_ERR, cf->stable.glog,
+          "can't write to control connection");
+        conn_remove(idx);
+    }
+}
 
 static void
 process_commands(struct cfg *cf, int controlfd_in, double dtime)
@@ -43,31 +356,53 @@ process_commands(struct cfg *cf, int controlfd_in, double dtime)
     int controlfd, i;
     socklen_t rlen;
     struct sockaddr_un ifsun;
-    struct rtpp_command cmd;
+    struct rtpp_command cmd, *cmdp;
+    struct rtpp_cmd_item *item;
+
+    if (cf->stable.umode != 0) {
+        process_commands_udp(cf, controlfd_in, dtime);
+        return;
+    }
 
     do {
-        if (cf->stable.umode == 0) {
-            rlen = sizeof(ifsun);
-            controlfd = accept(controlfd_in, sstosa(&ifsun), &rlen);
-            if (controlfd == -1) {
-                if (errno != EWOULDBLOCK)
-                    rtpp_log_ewrite(RTPP_LOG_ERR, cf->stable.glog,
-                      "can't accept connection on control socket");
+        rlen = sizeof(ifsun);
+        controlfd = accept(controlfd_in, sstosa(&ifsun), &rlen);
+        if (controlfd == -1) {
+            if (errno != EWOULDBLOCK)
+                rtpp_log_ewrite(RTPP_LOG_ERR, cf->stable.glog,
+                  "can't accept connection on control socket");
+            break;
+        }
+        item = NULL;
+        cmdp = &cmd;
+        if (cf->stable.cmd_workers > 1) {
+            item = malloc(sizeof(*item));
+            if (item == NULL) {
+                rtpp_log_ewrite(RTPP_LOG_ERR, cf->stable.glog,
+                  "can't allocate memory");
+                close(controlfd);
                 break;
             }
-        } else {
-            controlfd = controlfd_in;
-        }
-        if (get_command(&cf->stable, controlfd, &cmd) > 0) {
-            pthread_mutex_lock(&cf->glock);
-            i = handle_command(cf, controlfd, &cmd, dtime);
-            pthread_mutex_unlock(&cf->glock);
-        } else {
-            i = -1;
+            cmdp = &item->cmd;
         }
-        if (cf->stable.umode == 0) {
+        if (get_command(&cf->stable, controlfd, cmdp) <= 0) {
+            free(item);
             close(controlfd);
+            break;
+        }
+        /* Version queries are answered here, as they may keep connection */
+        if (item != NULL && cmdp->argv[0][0] != 'v' && cmdp->argv[0][0] != 'V') {
+            item->controlfd = controlfd;
+            item->dtime = dtime;
+            dispatch_command(cf, item);
+            i = 0;
+            continue;
         }
+        cmdp->can_persist = (rtpp_cmd_nconns < RTPP_CMD_MAXCONNS);
+        i = run_command(cf, controlfd, cmdp, dtime);
+        if (cmdp->persist == 0 || conn_add(cf, controlfd) != 0)
+            close(controlfd);
+        free(item);
     } while (i == 0);
 }
 
@@ -75,8 +410,8 @@ static void
 rtpp_cmd_queue_run(void *arg)
 {
     struct cfg *cf;
-    struct pollfd pfds[1];
-    int i;
+    struct pollfd pfds[1 + RTPP_CMD_MAXCONNS];
+    int i, j, nconns;
     double eptime;
 
     cf = (struct cfg *)arg;
@@ -86,11 +421,29 @@ rtpp_cmd_queue_run(void *arg)
     pfds[0].revents = 0;
 
     for (;;) {
-        i = poll(pfds, 1, INFTIM);
+        nconns = rtpp_cmd_nconns;
+        for (j = 0; j < nconns; j++) {
+            pfds[1 + j].fd = rtpp_cmd_conns[j]->fd;
+            pfds[1 + j].events = POLLIN;
+            if (rtpp_cmd_conns[j]->olen > 0)
+                pfds[1 + j].events |= POLLOUT;
+            pfds[1 + j].revents = 0;
+        }
+        i = poll(pfds, 1 + nconns, INFTIM);
         if (i < 0 && errno == EINTR)
             continue;
         eptime = getdtime();
-        if (i > 0 && (pfds[0].revents & POLLIN) != 0) {
+        if (i <= 0)
+            continue;
+        /*
+         * Removed connection is replaced by the last one, so go from the
+         * end. Connections accepted below are added after these.
+         */
+        for (j = nconns - 1; j >= 0; j--) {
+            if (pfds[1 + j].revents != 0)
+                process_conn(cf, j, pfds[1 + j].revents, eptime);
+        }
+        if ((pfds[0].revents & POLLIN) != 0) {
             process_commands(cf, pfds[0].fd, eptime);
         }
     }
@@ -99,6 +452,24 @@ rtpp_cmd_queue_run(void *arg)
 int
 rtpp_command_async_init(struct cfg *cf)
 {
+    int i;
+
+    if (cf->stable.cmd_workers > 1) {
+        rtpp_cmd_shards = malloc(cf->stable.cmd_workers *
+          sizeof(*rtpp_cmd_shards));
+        if (rtpp_cmd_shards == NULL)
+            return -1;
+        memset(rtpp_cmd_shards, 0, cf->stable.cmd_workers *
+          sizeof(*rtpp_cmd_shards));
+        for (i = 0; i < cf->stable.cmd_workers; i++) {
+            rtpp_cmd_shards[i].cf = cf;
+            pthread_mutex_init(&rtpp_cmd_shards[i].lock, NULL);
+            pthread_cond_init(&rtpp_cmd_shards[i].cond, NULL);
+            if (pthread_create(&rtpp_cmd_shards[i].thread, NULL,
+              (void *(*)(void *))&rtpp_cmd_shard_run, &rtpp_cmd_shards[i]) != 0)
+                return -1;
+        }
+    }
 
     if (pthread_create(&rtpp_cmd_queue, NULL, (void *(*)(void *))&rtpp_cmd_queue_run, cf) != 0)
         return -1;
@@ -100,7 +100,12 @@ struct cfg {
         const char *rdir;
         const char *sdir;
         int record_pcap;		/* Record in the PCAP format? */
+        int record_mux;		/* Record session into a single file? */
+        int record_pcapng;		/* Record in the pcapng format? */
+        int record_wav;		/* Record RTP as G.711 WAV? */
         int record_all;		/* Record everything */
+        int preroll;		/* Seconds of pre-roll kept for recording */
+        int cmd_workers;		/* Number of threads handling commands */
 
         int rrtcp;			/* Whether or not to relay RTCP? */
         rtpp_log_t glog;
@@ -124,7 +129,10 @@ struct cfg {
         uint8_t rand_table[256];
 
         int controlfd;
+        struct rtpp_rcache *rcache;	/* Replies to UDP commands, if cached */
         char *advertised;
+        const char *prompt_dir;		/* Prompts to preload, if any */
+        const char *tap_dir;		/* Where shm: taps are created */
     } stable;
 
     /*
@@ -139,11 +147,16 @@ struct cfg {
     } sessinfo;
     struct bindaddr_list *bindaddr_list;
     pthread_mutex_t bindaddr_lock;
+    /* Ports are allocated by the command workers without the glock */
+    int port_table_idx;
+    pthread_mutex_t port_lock;
 
     /* Structures below are protected by the glock */
-    struct rtpp_session **rtp_servers;
+    struct rtp_server **rtp_servers;
 
-    int rtp_nsessions;
+    int rtp_nservers;
+    struct rtp_server *rtp_bcasts;
+    struct rtp_mixer *rtp_mixers;
     int sessions_active;
     unsigned long long sessions_created;
     int nofile_limit_warned;
@@ -153,8 +166,6 @@ struct cfg {
     const char *timeout_socket;
     struct rtpp_timeout_handler *timeout_handler;
 
-    int port_table_idx;
-
     pthread_mutex_t glock;
 };
 
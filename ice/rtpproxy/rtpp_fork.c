@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#if defined(__linux__)
+/* sendmmsg(2) */
+#define	_GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rtp.h"
+#include "rtpp_log.h"
+#include "rtpp_network.h"
+#include "rtpp_fork.h"
+
+static int
+rtpp_fork_find(struct rtpp_fork *fp, const struct sockaddr *dst)
+{
+    int i;
+
+    for (i = 0; i < fp->ndsts; i++) {
+	if (sstosa(&fp->dsts[i])->sa_family != dst->sa_family)
+	    continue;
+	if (memcmp(&fp->dsts[i], dst, SA_LEN(dst)) == 0)
+	    return i;
+    }
+    return -1;
+}
+
+/*
+ * Add destination to the fork list, creating the list if necessary.
+ * Adding a destination that is already in the list is not an error.
+ */
+int
+rtpp_fork_add(struct rtpp_fork **fpp, const struct sockaddr *dst,
+  rtpp_log_t log)
+{
+    struct rtpp_fork *fp;
+
+    fp = *fpp;
+    if (fp == NULL) {
+	fp = malloc(sizeof(*fp));
+	if (fp == NULL) {
+	    rtpp_log_ewrite(RTPP_LOG_ERR, log, "can't allocate memory");
+	    return -1;
+	}
+	memset(fp, 0, sizeof(*fp));
+	fp->fd = socket(dst->sa_family, SOCK_DGRAM, 0);
+	if (fp->fd == -1) {
+	    rtpp_log_ewrite(RTPP_LOG_ERR, log, "can't create socket");
+	    free(fp);
+	    return -1;
+	}
+	*fpp = fp;
+    }
+    if (dst->sa_family != sstosa(&fp->dsts[0])->sa_family && fp->ndsts > 0) {
+	rtpp_log_write(RTPP_LOG_ERR, log, "can't mix address families in "
+	  "the fork list");
+	return -1;
+    }
+    if (rtpp_fork_find(fp, dst) != -1)
+	return 0;
+    if (fp->ndsts == RTPP_FORK_MAX) {
+	rtpp_log_write(RTPP_LOG_ERR, log, "too many fork destinations");
+	return -1;
+    }
+    memset(&fp->dsts[fp->ndsts], 0, sizeof(fp->dsts[0]));
+    memcpy(&fp->dsts[fp->ndsts], dst, SA_LEN(dst));
+    fp->ndsts++;
+    return 0;
+}
+
+/*
+ * Remove destination from the fork list or all of them if dst is NULL,
+ * the list is freed once empty.
+ */
+int
+rtpp_fork_remove(struct rtpp_fork **fpp, const struct sockaddr *dst)
+{
+    struct rtpp_fork *fp;
+    int i;
+
+    fp = *fpp;
+    if (fp == NULL)
+	return -1;
+    if (dst != NULL) {
+	i = rtpp_fork_find(fp, dst);
+	if (i == -1)
+	    return -1;
+	fp->ndsts--;
+	memcpy(&fp->dsts[i], &fp->dsts[fp->ndsts], sizeof(fp->dsts[0]));
+	if (fp->ndsts > 0)
+	    return 0;
+    }
+    rtpp_fork_free(fp);
+    *fpp = NULL;
+    return 0;
+}
+
+/*
+ * Send copy of the packet to all destinations, with a single system
+ * call where sendmmsg(2) is available.
+ */
+void
+rtpp_fork_send(struct rtpp_fork *fp, struct rtp_packet *packet)
+{
+    struct iovec iov;
+    int i;
+#if defined(MSG_WAITFORONE)
+    struct mmsghdr msgs[RTPP_FORK_MAX];
+    int n;
+#else
+    struct msghdr msg;
+#endif
+
+    iov.iov_base = packet->data.buf;
+    iov.iov_len = packet->size;
+#if defined(MSG_WAITFORONE)
+    memset(msgs, 0, fp->ndsts * sizeof(msgs[0]));
+    for (i = 0; i < fp->ndsts; i++) {
+	msgs[i].msg_hdr.msg_name = &fp->dsts[i];
+	msgs[i].msg_hdr.msg_namelen = SS_LEN(&fp->dsts[i]);
+	msgs[i].msg_hdr.msg_iov = &iov;
+	msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (i = 0; i < fp->ndsts; i += n) {
+	n = sendmmsg(fp->fd, &msgs[i], fp->ndsts - i, MSG_DONTWAIT);
+	/* Skip destination that has caused an error */
+	if (n <= 0)
+	    n = 1;
+    }
+#else
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    for (i = 0; i < fp->ndsts; i++) {
+	msg.msg_name = &fp->dsts[i];
+	msg.msg_namelen = SS_LEN(&fp->dsts[i]);
+	sendmsg(fp->fd, &msg, MSG_DONTWAIT);
+    }
+#endif
+}
+
+void
+rtpp_fork_free(struct rtpp_fork *fp)
+{
+
+    close(fp->fd);
+    free(fp);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RTPP_FORK_H_
+#define _RTPP_FORK_H_
+
+struct rtp_packet;
+
+/* Maximum number of destinations a single channel can be forked to */
+#define	RTPP_FORK_MAX	16
+
+/*
+ * Copies of packets received on a channel are sent to each destination
+ * in the list from the socket that belongs to the list.
+ */
+struct rtpp_fork {
+    int fd;
+    int ndsts;
+    struct sockaddr_storage dsts[RTPP_FORK_MAX];
+};
+
+int rtpp_fork_add(struct rtpp_fork **, const struct sockaddr *, rtpp_log_t);
+int rtpp_fork_remove(struct rtpp_fork **, const struct sockaddr *);
+void rtpp_fork_send(struct rtpp_fork *, struct rtp_packet *);
+void rtpp_fork_free(struct rtpp_fork *);
+
+#endif
@@ -241,13 +241,31 @@ rtpp_notify_init(rtpp_log_t glog, const char *socket_name)
     return th;
 }
 
+static int
+rtpp_notify_wi_setbuf(struct rtpp_notify_wi *wi, int len)
+{
+    char *notify_buf;
+
+    if (wi->notify_buf == NULL) {
+        wi->notify_buf = malloc(len);
+        if (wi->notify_buf == NULL)
+            return -1;
+    } else {
+        notify_buf = realloc(wi->notify_buf, len);
+        if (notify_buf == NULL)
+            return -1;
+        wi->notify_buf = notify_buf;
+    }
+    wi->len = len;
+    return 0;
+}
+
 int
 rtpp_notify_schedule(struct cfg *cf, struct rtpp_session *sp)
 {
     struct rtpp_notify_wi *wi;
     struct rtpp_timeout_handler *th = sp->timeout_data.handler;
     int len;
-    char *notify_buf;
 
     if (th == NULL) {
         /* Not an error, just nothing to do */
@@ -266,21 +284,10 @@ rtpp_notify_schedule(struct cfg *cf, struct rtpp_session *sp)
         /* string, \0 and \n */
         len = strlen(sp->timeout_data.notify_tag) + 2;
     }
-    if (wi->notify_buf == NULL) {
-        wi->notify_buf = malloc(len);
-        if (wi->notify_buf == NULL) {
-            rtpp_notify_queue_return_free_item(wi);
-            return -1;
-        }
-    } else {
-        notify_buf = realloc(wi->notify_buf, len);
-        if (notify_buf == NULL) {
-            rtpp_notify_queue_return_free_item(wi);
-            return -1;
-        }
-        wi->notify_buf = notify_buf;
+    if (rtpp_notify_wi_setbuf(wi, len) != 0) {
+        rtpp_notify_queue_return_free_item(wi);
+        return -1;
     }
-    wi->len = len;
 
     if (sp->timeout_data.notify_tag == NULL) {
         len = snprintf(wi->notify_buf, len, "%d %d\n",
@@ -296,6 +303,58 @@ rtpp_notify_schedule(struct cfg *cf, struct rtpp_session *sp)
     return 0;
 }
 
+/*
+ * Report DTMF digit received from the leg idx of the session, as
+ * "<tag> DTMF <digit> <duration_ms> <caller|callee>", where tag is
+ * either notify tag or pair of ports, the same as in the timeout
+ * notification.
+ */
+int
+rtpp_notify_schedule_dtmf(struct cfg *cf, struct rtpp_session *sp, int idx,
+  int digit, int duration)
+{
+    struct rtpp_notify_wi *wi;
+    struct rtpp_timeout_handler *th = sp->timeout_data.handler;
+    int len;
+
+    if (th == NULL) {
+        /* Not an error, just nothing to do */
+        return 0;
+    }
+
+    wi = rtpp_notify_queue_get_free_item();
+    if (wi == NULL)
+        return -1;
+
+    wi->th = th;
+    /* tag, the longest possible event description, \0 and \n */
+    if (sp->timeout_data.notify_tag == NULL) {
+        len = 5 + 5 + 1 + 32 + 2;
+    } else {
+        len = strlen(sp->timeout_data.notify_tag) + 32 + 2;
+    }
+    if (rtpp_notify_wi_setbuf(wi, len) != 0) {
+        rtpp_notify_queue_return_free_item(wi);
+        return -1;
+    }
+
+    if (sp->timeout_data.notify_tag == NULL) {
+        len = snprintf(wi->notify_buf, len, "%d %d DTMF %c %d %s\n",
+          sp->ports[0], sp->ports[1], digit, duration,
+          (idx == 0) ? "callee" : "caller");
+    } else {
+        len = snprintf(wi->notify_buf, len, "%s DTMF %c %d %s\n",
+          sp->timeout_data.notify_tag, digit, duration,
+          (idx == 0) ? "callee" : "caller");
+    }
+    wi->len = len + 1;
+
+    wi->glog = cf->stable.glog;
+
+    rtpp_notify_queue_put_item(wi);
+    return 0;
+}
+
 static void
 reconnect_timeout_handler(rtpp_log_t log, struct rtpp_timeout_handler *th)
 {
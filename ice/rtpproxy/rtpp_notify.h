@@ -40,6 +40,7 @@ struct rtpp_timeout_handler {
 };
 
 int rtpp_notify_schedule(struct cfg *, struct rtpp_session *);
+int rtpp_notify_schedule_dtmf(struct cfg *, struct rtpp_session *, int, int, int);
 struct rtpp_timeout_handler *rtpp_notify_init(rtpp_log_t, const char *);
 
 #endif
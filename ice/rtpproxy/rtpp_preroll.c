@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtp.h"
+#include "rtpp_network.h"
+#include "rtpp_preroll.h"
+#include "rtpp_record.h"
+#include "rtpp_session.h"
+
+/*
+ * Records are stored back to back in the ring buffer, a record that
+ * doesn't fit at the end goes to the beginning, with the marker left
+ * in place of the unused space if there is room for it.
+ */
+struct rpr_hdr {
+    double rtime;
+    union sockaddr_in_s raddr;
+    int plen;
+    int rlen;
+};
+
+#define	RPR_WRAP	(-1)
+#define	RPR_ALIGN(x)	(((x) + 7) & ~7)
+
+static struct rpr_hdr *
+rpr_at(struct rtpp_preroll *rp, int off)
+{
+
+    return (struct rpr_hdr *)(rp->buf + off);
+}
+
+static struct rpr_hdr *
+rpr_head(struct rtpp_preroll *rp)
+{
+
+    if (rp->size - rp->head < (int)sizeof(struct rpr_hdr) ||
+      rpr_at(rp, rp->head)->plen == RPR_WRAP)
+	rp->head = 0;
+    return rpr_at(rp, rp->head);
+}
+
+/* Drop the oldest record */
+static void
+rpr_pop(struct rtpp_preroll *rp)
+{
+
+    rp->head += rpr_head(rp)->rlen;
+    rp->nrecs--;
+    if (rp->nrecs == 0)
+	rp->head = rp->tail = 0;
+}
+
+/*
+ * Create pre-roll buffer holding up to secs seconds of packets received
+ * on an RTP or RTCP channel.
+ */
+struct rtpp_preroll *
+rtpp_preroll_new(int secs, int rtcp)
+{
+    struct rtpp_preroll *rp;
+
+    rp = malloc(sizeof(*rp));
+    if (rp == NULL)
+	return NULL;
+    memset(rp, 0, sizeof(*rp));
+    rp->size = RPR_ALIGN(secs * ((rtcp != 0) ? RPR_RTCP_RATE : RPR_RTP_RATE));
+    rp->buf = malloc(rp->size);
+    if (rp->buf == NULL) {
+	free(rp);
+	return NULL;
+    }
+    rp->ttl = secs;
+    return rp;
+}
+
+void
+rtpp_preroll_free(struct rtpp_preroll *rp)
+{
+
+    free(rp->buf);
+    free(rp);
+}
+
+/*
+ * Save a copy of the packet, dropping the packets that are older than
+ * the pre-roll time or don't leave enough room for it.
+ */
+void
+rtpp_preroll_put(struct rtpp_preroll *rp, struct rtp_packet *packet)
+{
+    struct rpr_hdr *hp;
+    int rlen;
+
+    rlen = RPR_ALIGN(sizeof(*hp) + packet->size);
+    if (rlen > rp->size)
+	return;
+
+    while (rp->nrecs > 0 && rpr_head(rp)->rtime < packet->rtime - rp->ttl)
+	rpr_pop(rp);
+
+    for (;;) {
+	if (rp->nrecs == 0)
+	    break;
+	if (rp->tail > rp->head) {
+	    if (rp->size - rp->tail >= rlen)
+		break;
+	    if (rp->head >= rlen) {
+		/* Continue from the beginning of the buffer */
+		if (rp->size - rp->tail >= (int)sizeof(*hp))
+		    rpr_at(rp, rp->tail)->plen = RPR_WRAP;
+		rp->tail = 0;
+		break;
+	    }
+	} else if (rp->head - rp->tail >= rlen) {
+	    break;
+	}
+	rpr_pop(rp);
+    }
+
+    hp = rpr_at(rp, rp->tail);
+    hp->rtime = packet->rtime;
+    memcpy(&hp->raddr, &packet->raddr, SA_LEN(sstosa(&packet->raddr)));
+    hp->plen = packet->size;
+    hp->rlen = rlen;
+    memcpy(hp + 1, packet->data.buf, packet->size);
+    rp->tail += rlen;
+    rp->nrecs++;
+}
+
+/*
+ * Write everything saved so far into the recording opened for the
+ * channel idx of the session, emptying the buffer.
+ */
+void
+rtpp_preroll_flush(struct rtpp_preroll *rp, struct rtpp_session *sp, int idx,
+  void *rrc)
+{
+    struct rtp_packet *packet;
+    struct rpr_hdr *hp;
+
+    packet = rtp_packet_alloc();
+    if (packet == NULL)
+	return;
+    while (rp->nrecs > 0) {
+	hp = rpr_head(rp);
+	memset(&packet->raddr, 0, sizeof(packet->raddr));
+	memcpy(&packet->raddr, &hp->raddr, sizeof(hp->raddr));
+	packet->laddr = sp->laddr[idx];
+	packet->rport = sp->ports[idx];
+	packet->rtime = hp->rtime;
+	packet->size = hp->plen;
+	memcpy(packet->data.buf, hp + 1, hp->plen);
+	rwrite(sp, rrc, packet);
+	rpr_pop(rp);
+    }
+    rtp_packet_free(packet);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RTPP_PREROLL_H_
+#define _RTPP_PREROLL_H_
+
+struct rtp_packet;
+struct rtpp_session;
+
+/*
+ * Packets received on a channel that is not being recorded are kept in
+ * memory for the last few seconds, so that recording started later can
+ * include some audio preceding the request.
+ */
+struct rtpp_preroll {
+    unsigned char *buf;
+    int size;
+    /* Offsets of the oldest record and of the free space after the newest */
+    int head;
+    int tail;
+    int nrecs;
+    /* How long packets are kept, in seconds */
+    double ttl;
+};
+
+/* Memory reserved per second of pre-roll for RTP and RTCP channels */
+#define	RPR_RTP_RATE	(16 * 1024)
+#define	RPR_RTCP_RATE	(1024)
+
+struct rtpp_preroll *rtpp_preroll_new(int, int);
+void rtpp_preroll_free(struct rtpp_preroll *);
+void rtpp_preroll_put(struct rtpp_preroll *, struct rtp_packet *);
+void rtpp_preroll_flush(struct rtpp_preroll *, struct rtpp_session *, int,
+  void *);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rtpp_rcache.h"
+#include "rtpp_util.h"
+
+#define	RTPP_RCACHE_NBUCKETS	1024
+
+struct rtpp_rcache_ent {
+    struct sockaddr_storage addr;
+    socklen_t alen;
+    char cookie[RTPP_RCACHE_COOKIE_MAX + 1];
+    /* -1 until the reply is stored, -2 if it can't be */
+    int reply_len;
+    char reply[RTPP_RCACHE_REPLY_MAX];
+    double etime;
+    unsigned int hash;
+    struct rtpp_rcache_ent *hnext;
+    /* Entries are kept in the order they expire in */
+    struct rtpp_rcache_ent *next;
+};
+
+struct rtpp_rcache {
+    pthread_mutex_t lock;
+    struct rtpp_rcache_ent *buckets[RTPP_RCACHE_NBUCKETS];
+    struct rtpp_rcache_ent *head, *tail;
+    int nents;
+};
+
+struct rtpp_rcache *
+rtpp_rcache_new(void)
+{
+    struct rtpp_rcache *rc;
+
+    rc = malloc(sizeof(*rc));
+    if (rc == NULL)
+	return NULL;
+    memset(rc, 0, sizeof(*rc));
+    pthread_mutex_init(&rc->lock, NULL);
+    return rc;
+}
+
+static unsigned int
+rtpp_rcache_hash(const struct sockaddr *addr, socklen_t alen,
+  const char *cookie)
+{
+    const unsigned char *cp;
+    unsigned int hash;
+
+    hash = 5381;
+    for (cp = (const unsigned char *)cookie; *cp != '\0'; cp++)
+	hash = hash * 33 + *cp;
+    for (cp = (const unsigned char *)addr; alen > 0; cp++, alen--)
+	hash = hash * 33 + *cp;
+    return hash;
+}
+
+/* Unlink entry from the hash chain, it must be in the chain */
+static void
+rtpp_rcache_unhash(struct rtpp_rcache *rc, struct rtpp_rcache_ent *ent)
+{
+    struct rtpp_rcache_ent **epp;
+
+    for (epp = &rc->buckets[ent->hash % RTPP_RCACHE_NBUCKETS]; *epp != ent;
+      epp = &(*epp)->hnext)
+	continue;
+    *epp = ent->hnext;
+}
+
+/* Drop expired entries, and the oldest one if the cache is full */
+static void
+rtpp_rcache_expire(struct rtpp_rcache *rc, double dtime)
+{
+    struct rtpp_rcache_ent *ent;
+
+    while (rc->head != NULL &&
+      (rc->head->etime <= dtime || rc->nents >= RTPP_RCACHE_MAX)) {
+	ent = rc->head;
+	rc->head = ent->next;
+	if (rc->head == NULL)
+	    rc->tail = NULL;
+	rtpp_rcache_unhash(rc, ent);
+	rc->nents--;
+	free(ent);
+    }
+}
+
+static struct rtpp_rcache_ent *
+rtpp_rcache_find(struct rtpp_rcache *rc, const struct sockaddr *addr,
+  socklen_t alen, const char *cookie, unsigned int hash)
+{
+    struct rtpp_rcache_ent *ent;
+
+    for (ent = rc->buckets[hash % RTPP_RCACHE_NBUCKETS]; ent != NULL;
+      ent = ent->hnext) {
+	if (ent->hash == hash && ent->alen == alen &&
+	  memcmp(&ent->addr, addr, alen) == 0 &&
+	  strcmp(ent->cookie, cookie) == 0)
+	    return ent;
+    }
+    return NULL;
+}
+
+/*
+ * Look up command with the given cookie received from the address. If
+ * the reply to it is known, it's copied into the buf. Otherwise, the
+ * command is remembered as being handled, so that its retransmits are
+ * ignored until the reply is stored.
+ */
+int
+rtpp_rcache_check(struct rtpp_rcache *rc, const struct sockaddr *addr,
+  socklen_t alen, const char *cookie, char *buf, int *len)
+{
+    struct rtpp_rcache_ent *ent;
+    unsigned int hash;
+    int rval;
+
+    if (strlen(cookie) > RTPP_RCACHE_COOKIE_MAX ||
+      alen > sizeof(struct sockaddr_storage))
+	return RTPP_RCACHE_MISS;
+    hash = rtpp_rcache_hash(addr, alen, cookie);
+
+    pthread_mutex_lock(&rc->lock);
+    rtpp_rcache_expire(rc, getdtime());
+    ent = rtpp_rcache_find(rc, addr, alen, cookie, hash);
+    if (ent != NULL && ent->reply_len != -2) {
+	if (ent->reply_len == -1) {
+	    rval = RTPP_RCACHE_PENDING;
+	} else {
+	    memcpy(buf, ent->reply, ent->reply_len);
+	    *len = ent->reply_len;
+	    rval = RTPP_RCACHE_HIT;
+	}
+	pthread_mutex_unlock(&rc->lock);
+	return rval;
+    }
+    if (ent != NULL) {
+	pthread_mutex_unlock(&rc->lock);
+	return RTPP_RCACHE_MISS;
+    }
+
+    ent = malloc(sizeof(*ent));
+    if (ent != NULL) {
+	memcpy(&ent->addr, addr, alen);
+	ent->alen = alen;
+	strcpy(ent->cookie, cookie);
+	ent->reply_len = -1;
+	ent->etime = getdtime() + RTPP_RCACHE_TTL;
+	ent->hash = hash;
+	ent->hnext = rc->buckets[hash % RTPP_RCACHE_NBUCKETS];
+	rc->buckets[hash % RTPP_RCACHE_NBUCKETS] = ent;
+	ent->next = NULL;
+	if (rc->tail == NULL)
+	    rc->head = ent;
+	else
+	    rc->tail->next = ent;
+	rc->tail = ent;
+	rc->nents++;
+    }
+    pthread_mutex_unlock(&rc->lock);
+    return RTPP_RCACHE_MISS;
+}
+
+/*
+ * Remember reply to the command, only the first reply is kept. If the
+ * reply is too long or buf is NULL, because the command has been
+ * dropped, retransmits of the command are handled as new commands.
+ */
+void
+rtpp_rcache_store(struct rtpp_rcache *rc, const struct sockaddr *addr,
+  socklen_t alen, const char *cookie, const char *buf, int len)
+{
+    struct rtpp_rcache_ent *ent;
+    unsigned int hash;
+
+    if (strlen(cookie) > RTPP_RCACHE_COOKIE_MAX ||
+      alen > sizeof(struct sockaddr_storage))
+	return;
+    hash = rtpp_rcache_hash(addr, alen, cookie);
+
+    pthread_mutex_lock(&rc->lock);
+    ent = rtpp_rcache_find(rc, addr, alen, cookie, hash);
+    if (ent != NULL && ent->reply_len == -1) {
+	if (buf != NULL && len <= RTPP_RCACHE_REPLY_MAX) {
+	    memcpy(ent->reply, buf, len);
+	    ent->reply_len = len;
+	} else {
+	    ent->reply_len = -2;
+	}
+    }
+    pthread_mutex_unlock(&rc->lock);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RTPP_RCACHE_H_
+#define _RTPP_RCACHE_H_
+
+/*
+ * Replies to commands received over UDP are remembered for a while
+ * by the source address and cookie of the command, so that commands
+ * retransmitted by the client are answered without handling them again.
+ */
+#define	RTPP_RCACHE_TTL		30	/* Seconds replies are kept for */
+#define	RTPP_RCACHE_MAX		4096	/* Maximum number of replies kept */
+#define	RTPP_RCACHE_COOKIE_MAX	64	/* Longer cookies aren't cached */
+#define	RTPP_RCACHE_REPLY_MAX	256	/* Longer replies aren't cached */
+
+/* Result of rtpp_rcache_check() */
+#define	RTPP_RCACHE_MISS	0	/* New command, should be handled */
+#define	RTPP_RCACHE_PENDING	1	/* Original command is being handled */
+#define	RTPP_RCACHE_HIT		2	/* Reply to the command is known */
+
+struct rtpp_rcache;
+
+struct rtpp_rcache *rtpp_rcache_new(void);
+int rtpp_rcache_check(struct rtpp_rcache *, const struct sockaddr *, socklen_t,
+  const char *, char *, int *);
+void rtpp_rcache_store(struct rtpp_rcache *, const struct sockaddr *,
+  socklen_t, const char *, const char *, int);
+
+#endif
@@ -29,44 +29,1137 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "rtp_codec.h"
+#include "rtp_g711.h"
 #include "rtpp_log.h"
+#include "rtpp_network.h"
 #include "rtpp_record.h"
 #include "rtpp_session.h"
+#include "rtpp_tap.h"
 #include "rtpp_util.h"
 
-enum record_mode {MODE_LOCAL_PKT, MODE_REMOTE_RTP, MODE_LOCAL_PCAP}; /* MODE_LOCAL_RTP/MODE_REMOTE_PKT? */
+enum record_mode {MODE_LOCAL_PKT, MODE_REMOTE_RTP, MODE_LOCAL_PCAP, MODE_LOCAL_MUX,
+  MODE_LOCAL_PCAPNG, MODE_REMOTE_STREAM, MODE_LOCAL_WAV, MODE_REMOTE_SHM}; /* MODE_LOCAL_RTP/MODE_REMOTE_PKT? */
+
+/*
+ * Local recordings are written by the separate thread, so that the disk
+ * I/O never blocks relaying. Relay thread only fills channel's buffer and
+ * hands it over to the writer once it's full.
+ */
+#define	RRC_BUF_SIZE	(64 * 1024)
+#define	RRC_BUF_ALIGN	4096
+/*
+ * Limit on the memory taken by the recordings disk can't keep up with.
+ * Only buffers handed over to the writer count, the one each channel is
+ * filling is not, so that the number of open recordings doesn't matter.
+ */
+#define	RRC_MAX_BUFS	1024
+/* Maximum number of buffers written out in a single writev() */
+#define	RRC_MAX_IOV	16
+
+/*
+ * Streamed recordings are handed over to the writer at least this often
+ * (in seconds) rather than once the buffer is full. Streams are sent by
+ * their own writer over non-blocking sockets, so that a slow collector
+ * holds up neither local recordings nor other collectors. Number of
+ * buffers waiting to be sent is limited per stream, so that a slow
+ * collector only looses its own packets, writer gives up on the
+ * collector that doesn't accept any data for RRS_SND_TIMEO seconds.
+ */
+#define	RRS_FLUSH_IVAL	0.2
+#define	RRS_MAX_BUFS	64
+#define	RRS_SND_TIMEO	5
+/* How long (in ms) new buffers may wait while the writer polls streams */
+#define	RRS_POLL_IVAL	50
+
+enum rrb_op {RRB_WRITE, RRB_CLOSE, RRB_REMOVE};
+
+struct rtpp_record_channel;
+
+struct rtpp_record_buf {
+    unsigned char *data;
+    int len;
+    struct rtpp_record_channel *rrc;
+    /* What writer has to do with the channel after writing the data */
+    enum rrb_op op;
+    struct rtpp_record_buf *next;
+};
 
 struct rtpp_record_channel {
     char spath[PATH_MAX + 1];
     char rpath[PATH_MAX + 1];
     int fd;
     int needspool;
-    char rbuf[4096];
-    int rbuf_len;
+    /* Buffer being filled by the relay thread */
+    struct rtpp_record_buf *rbuf;
+    /* Set by the writer once writing to the file has failed */
+    int failed;
+    unsigned long ndropped;
+    /* Number of buffers queued for writing, protected by queue mutex */
+    int nqueued;
+    double flush_time;
+    /*
+     * Buffers of the stream waiting to be sent, owned by the stream
+     * writer along with the list of streams that have data pending.
+     */
+    struct rtpp_record_buf *sq, *sq_tail;
+    int sq_off;
+    double sq_progress;
+    struct rtpp_record_channel *snext;
     enum record_mode mode;
+    /* Number of bytes recorded so far */
+    uint64_t offset;
+    /*
+     * In the multiplexed mode the channel is shared by all channels of
+     * the session and carries the index to be appended on close.
+     */
+    int refcnt;
+    int keep;
+    struct rtpx_idx_ent *idx;
+    int idx_nents;
+    int idx_size;
+    double idx_last;
+    uint32_t npkts[RTPX_NCHANS];
+    /*
+     * In the pcapng mode fake IP/UDP headers are prepared once for
+     * the current source of packets, only lengths and checksums are
+     * filled in for each packet.
+     */
+    struct sockaddr_storage ng_src;
+    unsigned char ng_hdr[sizeof(struct ip6_hdr) + sizeof(struct udphdr)];
+    int ng_hdr_len;
+    uint32_t ng_sum;
+    /*
+     * In the WAV mode position in the file is derived from the RTP
+     * timestamp relative to the anchor, set by the first packet and
+     * reset whenever timestamps jump.
+     */
+    int wav_fmt;
+    int wav_anchored;
+    uint32_t wav_ssrc;
+    uint32_t wav_base_ts;
+    int64_t wav_base_pos;
+    double wav_start;
+    unsigned char wav_hdr[WAV_HDR_LEN];
+    /*
+     * In the shared memory mode packets of all channels of the session
+     * are put into the tap ring directly by the relay thread.
+     */
+    struct rtpp_tap *tap;
+    uint64_t tap_sess;
 };
 
 #define	RRC_CAST(x)	((struct rtpp_record_channel *)(x))
 
+struct rtpp_record_queue {
+    pthread_t thread;
+    pthread_cond_t cond;
+    pthread_mutex_t mutex;
+    struct rtpp_record_buf *head, *tail;
+};
+
+/* Queues of the local files writer and of the streams writer */
+static struct rtpp_record_queue rtpp_record_fq, rtpp_record_sq;
+static pthread_mutex_t rtpp_record_buf_free_mutex;
+
+static rtpp_log_t rtpp_record_glog;
+/* Buffers handed over to the writer, protected by the free list mutex */
+static int rtpp_record_nqueued;
+
+static struct rtpp_record_buf *rtpp_record_buf_free;
+
+#define	RRC_QUEUE(rrc)	(((rrc)->mode == MODE_REMOTE_STREAM) ? \
+  &rtpp_record_sq : &rtpp_record_fq)
+
+/*
+ * Get an empty buffer. Unless force is set, NULL is returned once too
+ * much data is waiting to be written.
+ */
+static struct rtpp_record_buf *
+rtpp_record_buf_get(int force)
+{
+    struct rtpp_record_buf *buf;
+    void *data;
+
+    pthread_mutex_lock(&rtpp_record_buf_free_mutex);
+    if (force == 0 && rtpp_record_nqueued >= RRC_MAX_BUFS) {
+	pthread_mutex_unlock(&rtpp_record_buf_free_mutex);
+	return NULL;
+    }
+    buf = rtpp_record_buf_free;
+    if (buf != NULL) {
+	rtpp_record_buf_free = buf->next;
+    } else {
+	buf = malloc(sizeof(*buf));
+	if (buf != NULL) {
+	    if (posix_memalign(&data, RRC_BUF_ALIGN, RRC_BUF_SIZE) != 0) {
+		free(buf);
+		buf = NULL;
+	    } else {
+		buf->data = data;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&rtpp_record_buf_free_mutex);
+
+    if (buf != NULL) {
+	buf->len = 0;
+	buf->rrc = NULL;
+	buf->op = RRB_WRITE;
+    }
+    return buf;
+}
+
+static void
+rtpp_record_buf_return(struct rtpp_record_buf *buf)
+{
+
+    pthread_mutex_lock(&rtpp_record_buf_free_mutex);
+    buf->next = rtpp_record_buf_free;
+    rtpp_record_buf_free = buf;
+    rtpp_record_nqueued--;
+    pthread_mutex_unlock(&rtpp_record_buf_free_mutex);
+}
+
+/* Number of buffers of the channel waiting for its writer */
+static int
+rtpp_record_queue_len(struct rtpp_record_channel *rrc)
+{
+    struct rtpp_record_queue *q;
+    int n;
+
+    q = RRC_QUEUE(rrc);
+    pthread_mutex_lock(&q->mutex);
+    n = rrc->nqueued;
+    pthread_mutex_unlock(&q->mutex);
+    return n;
+}
+
+static void
+rtpp_record_queue_put_buf(struct rtpp_record_buf *buf)
+{
+    struct rtpp_record_queue *q;
+
+    pthread_mutex_lock(&rtpp_record_buf_free_mutex);
+    rtpp_record_nqueued++;
+    pthread_mutex_unlock(&rtpp_record_buf_free_mutex);
+
+    q = RRC_QUEUE(buf->rrc);
+    pthread_mutex_lock(&q->mutex);
+
+    buf->next = NULL;
+    buf->rrc->nqueued++;
+    if (q->head == NULL) {
+	q->head = buf;
+	q->tail = buf;
+    } else {
+	q->tail->next = buf;
+	q->tail = buf;
+    }
+
+    /* notify worker thread */
+    pthread_cond_signal(&q->cond);
+
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static void
+rtpp_record_write(struct rtpp_record_channel *rrc, struct iovec *v, int n)
+{
+    ssize_t len;
+
+    if (rrc->fd == -1)
+	return;
+
+    while (n > 0) {
+	len = writev(rrc->fd, v, n);
+	if (len == -1) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	for (; n > 0 && len >= (ssize_t)v->iov_len; v++, n--)
+	    len -= v->iov_len;
+	if (n > 0) {
+	    v->iov_base = (char *)v->iov_base + len;
+	    v->iov_len -= len;
+	}
+    }
+    if (n == 0)
+	return;
+
+    rtpp_log_ewrite(RTPP_LOG_ERR, rtpp_record_glog, "error while recording "
+      "session to %s", rrc->spath);
+    /* Prevent futher writing if error happens */
+    close(rrc->fd);
+    rrc->fd = -1;
+    rrc->failed = 1;
+}
+
+static void
+rtpp_record_finish(struct rtpp_record_channel *rrc, int keep)
+{
+
+    if (rrc->mode == MODE_LOCAL_WAV && rrc->fd != -1 && keep != 0 &&
+      pwrite(rrc->fd, rrc->wav_hdr, WAV_HDR_LEN, 0) != WAV_HDR_LEN)
+	rtpp_log_ewrite(RTPP_LOG_ERR, rtpp_record_glog, "can't update header "
+	  "of session record %s", rrc->spath);
+
+    if (rrc->fd != -1)
+	close(rrc->fd);
+    if (rrc->idx != NULL)
+	free(rrc->idx);
+
+    if (rrc->ndropped > 0)
+	rtpp_log_write(RTPP_LOG_WARN, rtpp_record_glog, "%lu packets haven't "
+	  "been recorded to %s due to the %s being too slow", rrc->ndropped,
+	  rrc->spath, (rrc->mode == MODE_REMOTE_STREAM) ? "collector" : "disk");
+
+    if (rrc->mode == MODE_REMOTE_STREAM) {
+	/* Nothing to do, collector has the data already */
+    } else if (keep == 0) {
+	if (unlink(rrc->spath) == -1)
+	    rtpp_log_ewrite(RTPP_LOG_ERR, rtpp_record_glog, "can't remove "
+	      "session record %s", rrc->spath);
+    } else if (rrc->needspool == 1) {
+	if (rename(rrc->spath, rrc->rpath) == -1)
+	    rtpp_log_ewrite(RTPP_LOG_ERR, rtpp_record_glog, "can't move "
+	      "session record from spool into permanent storage");
+    }
+
+    free(rrc);
+}
+
+static void
+rtpp_record_queue_run(void)
+{
+    struct rtpp_record_buf *queue, *buf, *last, *nbuf;
+    struct rtpp_record_channel *rrc;
+    struct iovec v[RRC_MAX_IOV];
+    enum rrb_op op;
+    int n;
+
+    for (;;) {
+	pthread_mutex_lock(&rtpp_record_fq.mutex);
+	while (rtpp_record_fq.head == NULL) {
+	    pthread_cond_wait(&rtpp_record_fq.cond, &rtpp_record_fq.mutex);
+	}
+	/* Take everything that has been queued so far */
+	queue = rtpp_record_fq.head;
+	rtpp_record_fq.head = NULL;
+	pthread_mutex_unlock(&rtpp_record_fq.mutex);
+
+	while (queue != NULL) {
+	    /* Consecutive buffers of the same channel go in one write */
+	    rrc = queue->rrc;
+	    last = NULL;
+	    n = 0;
+	    for (buf = queue; buf != NULL && buf->rrc == rrc &&
+	      n < RRC_MAX_IOV; buf = buf->next) {
+		v[n].iov_base = buf->data;
+		v[n].iov_len = buf->len;
+		n++;
+		last = buf;
+		if (buf->op != RRB_WRITE)
+		    break;
+	    }
+	    rtpp_record_write(rrc, v, n);
+
+	    op = last->op;
+	    for (buf = queue; ; buf = nbuf) {
+		nbuf = buf->next;
+		rtpp_record_buf_return(buf);
+		if (buf == last)
+		    break;
+	    }
+	    queue = nbuf;
+
+	    pthread_mutex_lock(&rtpp_record_fq.mutex);
+	    rrc->nqueued -= n;
+	    pthread_mutex_unlock(&rtpp_record_fq.mutex);
+
+	    if (op != RRB_WRITE)
+		rtpp_record_finish(rrc, op == RRB_CLOSE);
+	}
+    }
+}
+
+/*
+ * Release the buffer at the head of the stream's queue, returns what has
+ * to be done with the channel afterwards.
+ */
+static enum rrb_op
+rstream_pop(struct rtpp_record_channel *rrc)
+{
+    struct rtpp_record_buf *buf;
+    enum rrb_op op;
+
+    buf = rrc->sq;
+    rrc->sq = buf->next;
+    rrc->sq_off = 0;
+    op = buf->op;
+    rtpp_record_buf_return(buf);
+
+    pthread_mutex_lock(&rtpp_record_sq.mutex);
+    rrc->nqueued--;
+    pthread_mutex_unlock(&rtpp_record_sq.mutex);
+    return op;
+}
+
+/*
+ * Send as much of the stream's queue as the socket accepts without
+ * blocking, returns what has to be done with the channel afterwards.
+ */
+static enum rrb_op
+rstream_send(struct rtpp_record_channel *rrc, double dtime)
+{
+    struct rtpp_record_buf *buf;
+    struct iovec v[RRC_MAX_IOV];
+    enum rrb_op op;
+    ssize_t len;
+    int n;
+
+    op = RRB_WRITE;
+    while (rrc->sq != NULL) {
+	n = 0;
+	for (buf = rrc->sq; buf != NULL && n < RRC_MAX_IOV; buf = buf->next) {
+	    v[n].iov_base = buf->data;
+	    v[n].iov_len = buf->len;
+	    n++;
+	}
+	v[0].iov_base = (char *)v[0].iov_base + rrc->sq_off;
+	v[0].iov_len -= rrc->sq_off;
+	len = writev(rrc->fd, v, n);
+	if (len == -1) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	    rtpp_log_ewrite(RTPP_LOG_ERR, rtpp_record_glog, "error while "
+	      "streaming session record to %s", rrc->spath);
+	    close(rrc->fd);
+	    rrc->fd = -1;
+	    rrc->failed = 1;
+	    break;
+	}
+	rrc->sq_progress = dtime;
+	len += rrc->sq_off;
+	while (rrc->sq != NULL && len >= rrc->sq->len) {
+	    len -= rrc->sq->len;
+	    op = rstream_pop(rrc);
+	}
+	rrc->sq_off = len;
+    }
+    return op;
+}
+
+static void
+rtpp_record_stream_run(void)
+{
+    struct rtpp_record_channel *streams, *rrc, **rrcp;
+    struct rtpp_record_buf *queue, *buf, *nbuf;
+    struct pollfd *pfds, *tp;
+    enum rrb_op op;
+    double dtime;
+    int i, n, pfds_size;
+
+    streams = NULL;
+    pfds = NULL;
+    pfds_size = 0;
+    for (;;) {
+	pthread_mutex_lock(&rtpp_record_sq.mutex);
+	while (rtpp_record_sq.head == NULL && streams == NULL) {
+	    pthread_cond_wait(&rtpp_record_sq.cond, &rtpp_record_sq.mutex);
+	}
+	queue = rtpp_record_sq.head;
+	rtpp_record_sq.head = NULL;
+	pthread_mutex_unlock(&rtpp_record_sq.mutex);
+
+	/* Move new buffers into the queues of their streams */
+	dtime = getdtime();
+	for (buf = queue; buf != NULL; buf = nbuf) {
+	    nbuf = buf->next;
+	    buf->next = NULL;
+	    rrc = buf->rrc;
+	    if (rrc->sq == NULL) {
+		rrc->sq = buf;
+		rrc->sq_progress = dtime;
+		rrc->snext = streams;
+		streams = rrc;
+	    } else {
+		rrc->sq_tail->next = buf;
+	    }
+	    rrc->sq_tail = buf;
+	}
+
+	n = 0;
+	for (rrc = streams; rrc != NULL; rrc = rrc->snext)
+	    n++;
+	if (n > pfds_size) {
+	    tp = realloc(pfds, n * sizeof(*pfds));
+	    if (tp != NULL) {
+		pfds = tp;
+		pfds_size = n;
+	    }
+	}
+	/* Streams that don't fit will be polled next time */
+	n = 0;
+	for (rrc = streams; rrc != NULL && n < pfds_size; rrc = rrc->snext) {
+	    pfds[n].fd = rrc->fd;
+	    pfds[n].events = POLLOUT;
+	    pfds[n].revents = 0;
+	    n++;
+	}
+	if (poll(pfds, n, RRS_POLL_IVAL) == -1 && errno != EINTR)
+	    rtpp_log_ewrite(RTPP_LOG_ERR, rtpp_record_glog, "can't poll "
+	      "recording collectors");
+	dtime = getdtime();
+
+	for (rrcp = &streams, i = 0; *rrcp != NULL; i++) {
+	    rrc = *rrcp;
+	    op = RRB_WRITE;
+	    if (rrc->fd != -1 && i < n && pfds[i].revents != 0)
+		op = rstream_send(rrc, dtime);
+	    if (rrc->fd != -1 && rrc->sq != NULL &&
+	      dtime - rrc->sq_progress >= RRS_SND_TIMEO) {
+		rtpp_log_write(RTPP_LOG_ERR, rtpp_record_glog, "recording "
+		  "collector %s doesn't accept data, giving up", rrc->spath);
+		close(rrc->fd);
+		rrc->fd = -1;
+		rrc->failed = 1;
+	    }
+	    /* Nothing can be sent once the stream has failed */
+	    while (rrc->fd == -1 && rrc->sq != NULL)
+		op = rstream_pop(rrc);
+	    if (rrc->sq == NULL)
+		*rrcp = rrc->snext;
+	    else
+		rrcp = &rrc->snext;
+	    if (op != RRB_WRITE)
+		rtpp_record_finish(rrc, op == RRB_CLOSE);
+	}
+    }
+}
+
+static int
+rtpp_record_queue_init(struct rtpp_record_queue *q, void (*run)(void))
+{
+
+    q->head = NULL;
+    q->tail = NULL;
+    pthread_cond_init(&q->cond, NULL);
+    pthread_mutex_init(&q->mutex, NULL);
+
+    if (pthread_create(&q->thread, NULL, (void *(*)(void *))run, NULL) != 0)
+	return -1;
+
+    return 0;
+}
+
+int
+rtpp_record_init(rtpp_log_t glog)
+{
+
+    rtpp_record_glog = glog;
+    rtpp_record_nqueued = 0;
+    rtpp_record_buf_free = NULL;
+
+    pthread_mutex_init(&rtpp_record_buf_free_mutex, NULL);
+
+    if (rtpp_record_queue_init(&rtpp_record_fq, &rtpp_record_queue_run) != 0 ||
+      rtpp_record_queue_init(&rtpp_record_sq, &rtpp_record_stream_run) != 0)
+	return -1;
+
+    return 0;
+}
+
+/*
+ * Append data to the channel, handing full buffers over to the writer.
+ * Used for the data that is allowed to span buffers. Unless force is
+ * set, only part of the data may be appended if the writer is behind.
+ */
+static int
+rrc_append(struct rtpp_record_channel *rrc, const void *data, int len,
+  int force)
+{
+    struct rtpp_record_buf *buf;
+    int n;
+
+    while (len > 0) {
+	buf = rrc->rbuf;
+	if (buf != NULL && buf->len == RRC_BUF_SIZE) {
+	    rtpp_record_queue_put_buf(buf);
+	    buf = rrc->rbuf = NULL;
+	}
+	if (buf == NULL) {
+	    buf = rtpp_record_buf_get(force);
+	    if (buf == NULL)
+		return -1;
+	    buf->rrc = rrc;
+	    rrc->rbuf = buf;
+	}
+	n = MIN(len, RRC_BUF_SIZE - buf->len);
+	memcpy(buf->data + buf->len, data, n);
+	buf->len += n;
+	rrc->offset += n;
+	data = (const char *)data + n;
+	len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Find multiplexed recording already opened for other channel of the
+ * session.
+ */
+static struct rtpp_record_channel *
+rmux_find(struct rtpp_session *sp, enum record_mode mode)
+{
+    struct rtpp_session *rsp;
+    int i;
+
+    rsp = GET_RTP(sp);
+    for (i = 0; i < 2; i++) {
+	if (rsp->rrcs[i] != NULL && RRC_CAST(rsp->rrcs[i])->mode == mode)
+	    return RRC_CAST(rsp->rrcs[i]);
+	if (rsp->rtcp->rrcs[i] != NULL &&
+	  RRC_CAST(rsp->rtcp->rrcs[i])->mode == mode)
+	    return RRC_CAST(rsp->rtcp->rrcs[i]);
+    }
+    return NULL;
+}
+
+static int
+rmux_chan(struct rtpp_session *sp, struct rtp_packet *packet)
+{
+    int chan;
+
+    chan = (sp->rtcp == NULL) ? RTPX_CHAN_RTCP : 0;
+    if (packet->rport == sp->ports[1])
+	chan |= RTPX_CHAN_ORIG;
+    return chan;
+}
+
+/* Add seek point pointing at the record about to be written */
+static void
+rmux_index(struct rtpp_record_channel *rrc, double dtime)
+{
+    struct rtpx_idx_ent *idx;
+    uint32_t ts_sec, ts_usec;
+    int size;
+
+    if (rrc->idx_nents == rrc->idx_size) {
+	size = (rrc->idx_size == 0) ? 64 : rrc->idx_size * 2;
+	idx = realloc(rrc->idx, size * sizeof(*idx));
+	if (idx == NULL)
+	    return;
+	rrc->idx = idx;
+	rrc->idx_size = size;
+    }
+    idx = &rrc->idx[rrc->idx_nents];
+    dtime2ts(dtime, &ts_sec, &ts_usec);
+    idx->ts_sec = ts_sec;
+    idx->ts_usec = ts_usec;
+    idx->offset = rrc->offset;
+    rrc->idx_nents++;
+    rrc->idx_last = dtime;
+}
+
+/* Append index and trailer to the multiplexed recording */
+static int
+rmux_finish(struct rtpp_record_channel *rrc)
+{
+    struct rtpx_trailer trailer;
+
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.idx_offset = rrc->offset;
+    trailer.idx_nents = rrc->idx_nents;
+    memcpy(trailer.npkts, rrc->npkts, sizeof(trailer.npkts));
+    trailer.magic = RTPX_TMAGIC;
+    if (rrc->idx_nents > 0 &&
+      rrc_append(rrc, rrc->idx, rrc->idx_nents * sizeof(rrc->idx[0]), 1) != 0)
+	return -1;
+    free(rrc->idx);
+    rrc->idx = NULL;
+    return rrc_append(rrc, &trailer, sizeof(trailer), 1);
+}
+
+static int
+pcapng_opt(unsigned char *bp, uint16_t code, const void *data, uint16_t len)
+{
+    int plen;
+
+    plen = (len + 3) & ~3;
+    memcpy(bp, &code, sizeof(code));
+    memcpy(bp + 2, &len, sizeof(len));
+    memset(bp + 4, 0, plen);
+    memcpy(bp + 4, data, len);
+    return 4 + plen;
+}
+
+/* Set length of the block that ends at the given position */
+static void
+pcapng_block_len(unsigned char *bp, unsigned char *ep)
+{
+    uint32_t len;
+
+    len = ep - bp + sizeof(len);
+    memcpy(bp + 4, &len, sizeof(len));
+    memcpy(ep, &len, sizeof(len));
+}
+
+/*
+ * Build Section Header and Interface Description blocks, the comment
+ * tells what's been recorded. Returns length of the data.
+ */
+static int
+pcapng_file_hdr(struct rtpp_session *sp, int orig, unsigned char *bp,
+  int size)
+{
+    unsigned char *cp, *hp;
+    uint32_t u32;
+    uint16_t u16;
+    int64_t s64;
+    char comment[256];
+    uint8_t tsresol;
+    int len;
+
+    len = snprintf(comment, sizeof(comment), "%s=%s %s %s", sp->call_id,
+      sp->tag, (orig != 0) ? "caller" : "callee",
+      (sp->rtcp != NULL) ? "RTP" : "RTCP");
+    if (len >= (int)sizeof(comment))
+	len = sizeof(comment) - 1;
+    if (size < len + 128)
+	return -1;
+
+    hp = cp = bp;
+    u32 = PCAPNG_BT_SHB;
+    memcpy(cp, &u32, 4);
+    cp += 8;
+    u32 = PCAPNG_BOM;
+    memcpy(cp, &u32, 4);
+    u16 = PCAPNG_VER_MAJR;
+    memcpy(cp + 4, &u16, 2);
+    u16 = PCAPNG_VER_MINR;
+    memcpy(cp + 6, &u16, 2);
+    /* Section length is not known */
+    s64 = -1;
+    memcpy(cp + 8, &s64, 8);
+    cp += 16;
+    cp += pcapng_opt(cp, PCAPNG_OPT_COMMENT, comment, len);
+    cp += pcapng_opt(cp, PCAPNG_OPT_SHB_USERAPPL, "rtpproxy", 8);
+    cp += pcapng_opt(cp, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+    pcapng_block_len(hp, cp);
+    cp += 4;
+
+    hp = cp;
+    u32 = PCAPNG_BT_IDB;
+    memcpy(cp, &u32, 4);
+    cp += 8;
+    u16 = LINKTYPE_RAW;
+    memcpy(cp, &u16, 2);
+    u16 = 0;
+    memcpy(cp + 2, &u16, 2);
+    u32 = 65535;
+    memcpy(cp + 4, &u32, 4);
+    cp += 8;
+    cp += pcapng_opt(cp, PCAPNG_OPT_IF_NAME, "rtpproxy", 8);
+    tsresol = 9;
+    cp += pcapng_opt(cp, PCAPNG_OPT_IF_TSRESOL, &tsresol, 1);
+    cp += pcapng_opt(cp, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+    pcapng_block_len(hp, cp);
+    cp += 4;
+
+    return cp - bp;
+}
+
+/*
+ * Start connecting to the collector, the connection is completed by the
+ * stream writer that never blocks on the socket.
+ */
+static int
+rstream_connect(struct rtpp_session *sp, struct rtpp_record_channel *rrc)
+{
+    union {
+	struct sockaddr_un u;
+	struct sockaddr_storage i;
+    } remote;
+    char host[PATH_MAX + 1], *hp, *port;
+    int remote_len, n;
+
+    memset(&remote, '\0', sizeof(remote));
+    if (strncmp("unix:", rrc->spath, 5) == 0) {
+	remote.u.sun_family = AF_LOCAL;
+	strncpy(remote.u.sun_path, rrc->spath + 5, sizeof(remote.u.sun_path) - 1);
+#if defined(HAVE_SOCKADDR_SUN_LEN)
+	remote.u.sun_len = strlen(remote.u.sun_path);
+#endif
+	remote_len = sizeof(remote.u);
+    } else {
+	strcpy(host, rrc->spath + 4);
+	port = strrchr(host, ':');
+	*port = '\0';
+	port++;
+	hp = host;
+	/* IPv6 address is enclosed in brackets, i.e. tcp:[::1]:port */
+	if (hp[0] == '[' && port - 2 > hp && port[-2] == ']') {
+	    port[-2] = '\0';
+	    hp++;
+	}
+	n = resolve(sstosa(&remote.i), AF_UNSPEC, hp, port, AI_PASSIVE);
+	if (n != 0) {
+	    rtpp_log_write(RTPP_LOG_ERR, sp->log, "can't resolve recording "
+	      "collector %s: %s", rrc->spath, gai_strerror(n));
+	    return -1;
+	}
+	remote_len = SA_LEN(sstosa(&remote.i));
+    }
+
+    rrc->fd = socket(sstosa(&remote.i)->sa_family, SOCK_STREAM, 0);
+    if (rrc->fd == -1) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't create socket");
+	return -1;
+    }
+    n = fcntl(rrc->fd, F_GETFL);
+    if (n == -1 || fcntl(rrc->fd, F_SETFL, n | O_NONBLOCK) == -1 ||
+      (connect(rrc->fd, sstosa(&remote.i), remote_len) == -1 &&
+      errno != EINPROGRESS)) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't connect to recording "
+	  "collector %s", rrc->spath);
+	close(rrc->fd);
+	rrc->fd = -1;
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Start streaming multiplexed recording of the session to the collector.
+ */
+static struct rtpp_record_channel *
+rstream_open(struct rtpp_session *sp, const char *target)
+{
+    struct rtpp_record_channel *rrc;
+    struct rtpx_stream_hdr stream_hdr;
+    struct rtpx_hdr rtpx_hdr;
+    char name[PATH_MAX + 1];
+    int len;
+
+    if (strncmp("tcp:", target, 4) == 0 && strrchr(target + 4, ':') == NULL) {
+	rtpp_log_write(RTPP_LOG_ERR, sp->log, "remote recording target specification should include port number");
+	return NULL;
+    }
+    if (strncmp("unix:", target, 5) == 0 &&
+      strlen(target + 5) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+	rtpp_log_write(RTPP_LOG_ERR, sp->log, "remote recording socket path is too long");
+	return NULL;
+    }
+    len = snprintf(name, sizeof(name), "%s=%s", sp->call_id, sp->tag);
+    if (len >= (int)sizeof(name) || strlen(target) >= sizeof(name)) {
+	rtpp_log_write(RTPP_LOG_ERR, sp->log, "recording name is too long");
+	return NULL;
+    }
+
+    rrc = malloc(sizeof(*rrc));
+    if (rrc == NULL) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't allocate memory");
+	return NULL;
+    }
+    memset(rrc, 0, sizeof(*rrc));
+    rrc->mode = MODE_REMOTE_STREAM;
+    rrc->fd = -1;
+    rrc->refcnt = 1;
+    strcpy(rrc->spath, target);
+    if (rstream_connect(sp, rrc) != 0) {
+	free(rrc);
+	return NULL;
+    }
+
+    rrc->rbuf = rtpp_record_buf_get(1);
+    if (rrc->rbuf == NULL) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't allocate memory");
+	close(rrc->fd);
+	free(rrc);
+	return NULL;
+    }
+    rrc->rbuf->rrc = rrc;
+
+    stream_hdr.magic = RTPX_SMAGIC;
+    stream_hdr.name_len = len;
+    rrc_append(rrc, &stream_hdr, sizeof(stream_hdr), 1);
+    rrc_append(rrc, name, len, 1);
+    /* Offsets in the index are relative to the start of the .rtpx data */
+    rrc->offset = 0;
+    rtpx_hdr.magic = RTPX_MAGIC;
+    rtpx_hdr.version = RTPX_VERSION;
+    rtpx_hdr.nchans = RTPX_NCHANS;
+    rrc_append(rrc, &rtpx_hdr, sizeof(rtpx_hdr), 1);
+
+    return rrc;
+}
+
+static void
+le_put(unsigned char *bp, uint32_t v, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	bp[i] = (v >> (i * 8)) & 0xff;
+}
+
+/* Prepare WAV header for the data recorded so far */
+static void
+rwav_hdr(struct rtpp_record_channel *rrc)
+{
+    unsigned char *bp;
+    uint32_t len;
+
+    bp = rrc->wav_hdr;
+    len = rrc->offset;
+    memcpy(bp, "RIFF", 4);
+    le_put(bp + 4, WAV_HDR_LEN - 8 + len, 4);
+    memcpy(bp + 8, "WAVE", 4);
+    memcpy(bp + 12, "fmt ", 4);
+    le_put(bp + 16, 18, 4);
+    le_put(bp + 20, (rrc->wav_fmt != 0) ? rrc->wav_fmt : WAV_FMT_ULAW, 2);
+    le_put(bp + 22, 1, 2);		/* Channels */
+    le_put(bp + 24, 8000, 4);		/* Sample rate */
+    le_put(bp + 28, 8000, 4);		/* Byte rate */
+    le_put(bp + 32, 1, 2);		/* Block align */
+    le_put(bp + 34, 8, 2);		/* Bits per sample */
+    le_put(bp + 36, 0, 2);		/* Extra format bytes */
+    memcpy(bp + 38, "fact", 4);
+    le_put(bp + 42, 4, 4);
+    le_put(bp + 46, len, 4);		/* Number of samples */
+    memcpy(bp + 50, "data", 4);
+    le_put(bp + 54, len, 4);
+}
+
+/* Place G.711 payload of the packet at its offset in the WAV file */
+static void
+rwav_write(struct rtpp_session *sp, struct rtpp_record_channel *rrc,
+  struct rtp_packet *packet)
+{
+    unsigned char silence[160], xbuf[sizeof(packet->data.buf)];
+    unsigned char *data;
+    int fmt, len, n;
+    int64_t apos, pos;
+    uint32_t ssrc;
+
+    if (rtp_packet_parse(packet, sp->rtpmap[(packet->rport == sp->ports[1]) ?
+      1 : 0]) != RTP_PARSER_OK || packet->codec == NULL)
+	return;
+    switch (packet->codec->id) {
+    case RTP_PCMU:
+	fmt = WAV_FMT_ULAW;
+	break;
+
+    case RTP_PCMA:
+	fmt = WAV_FMT_ALAW;
+	break;
+
+    default:
+	/* Comfort noise, DTMF and so on are left as silence */
+	return;
+    }
+
+    data = &packet->data.buf[packet->data_offset];
+    len = packet->data_size;
+    if (rrc->wav_fmt == 0) {
+	rrc->wav_fmt = fmt;
+	rrc->wav_start = packet->rtime;
+    } else if (fmt != rrc->wav_fmt) {
+	/* Party has switched to the other law, file can only have one */
+	if (fmt == WAV_FMT_ULAW)
+	    g711_ulaw2alaw(xbuf, data, len);
+	else
+	    g711_alaw2ulaw(xbuf, data, len);
+	data = xbuf;
+    }
+
+    apos = (packet->rtime - rrc->wav_start) * 8000;
+    ssrc = ntohl(packet->data.header.ssrc);
+    if (rrc->wav_anchored != 0) {
+	pos = rrc->wav_base_pos + (int32_t)(packet->ts - rrc->wav_base_ts);
+	if (ssrc != rrc->wav_ssrc || pos - apos > WAV_RESYNC ||
+	  apos - pos > WAV_RESYNC)
+	    rrc->wav_anchored = 0;
+    }
+    if (rrc->wav_anchored == 0) {
+	rrc->wav_anchored = 1;
+	rrc->wav_ssrc = ssrc;
+	rrc->wav_base_ts = packet->ts;
+	rrc->wav_base_pos = pos = apos;
+    }
+
+    /* Late packet, only the part after what is written already is used */
+    if (pos < (int64_t)rrc->offset) {
+	if (pos + len <= (int64_t)rrc->offset)
+	    return;
+	data += rrc->offset - pos;
+	len -= rrc->offset - pos;
+	pos = rrc->offset;
+    }
+
+    memset(silence, (rrc->wav_fmt == WAV_FMT_ULAW) ? 0xff : 0xd5,
+      sizeof(silence));
+    while ((int64_t)rrc->offset < pos) {
+	n = MIN(pos - (int64_t)rrc->offset, (int64_t)sizeof(silence));
+	if (rrc_append(rrc, silence, n, 0) != 0) {
+	    rrc->ndropped++;
+	    return;
+	}
+    }
+    if (rrc_append(rrc, data, len, 0) != 0)
+	rrc->ndropped++;
+}
+
+/* Fill in tap record for the packet, or session level one if it is NULL */
+static void
+rtap_rec(struct rtpp_session *sp, struct rtpp_record_channel *rrc,
+  struct rtp_packet *packet, int type, int plen, struct rtpp_tap_rec *rec)
+{
+    uint32_t ts_sec, ts_usec;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->type = type;
+    rec->sess_id = rrc->tap_sess;
+    rec->plen = plen;
+    if (packet == NULL) {
+	dtime2ts(getdtime(), &ts_sec, &ts_usec);
+	rec->ts_sec = ts_sec;
+	rec->ts_usec = ts_usec;
+	return;
+    }
+    rec->chan = rmux_chan(sp, packet);
+    rec->family = sstosa(&packet->raddr)->sa_family;
+    dtime2ts(packet->rtime, &ts_sec, &ts_usec);
+    rec->ts_sec = ts_sec;
+    rec->ts_usec = ts_usec;
+    switch (rec->family) {
+    case AF_INET:
+	rec->port = satosin(&packet->raddr)->sin_port;
+	memcpy(rec->addr, &satosin(&packet->raddr)->sin_addr, 4);
+	break;
+
+    case AF_INET6:
+	rec->port = satosin6(&packet->raddr)->sin6_port;
+	memcpy(rec->addr, &satosin6(&packet->raddr)->sin6_addr, 16);
+	break;
+    }
+}
+
+/*
+ * Start copying session to the shared memory tap, taps are only created
+ * in the configured directory and named by a plain file name.
+ */
+static struct rtpp_record_channel *
+rtap_open(struct cfg *cf, struct rtpp_session *sp, const char *target)
+{
+    struct rtpp_record_channel *rrc;
+    struct rtpp_tap_rec rec;
+    char name[PATH_MAX + 1], path[PATH_MAX + 1];
+    const char *tname;
+    int len;
+
+    if (cf->stable.tap_dir == NULL) {
+	rtpp_log_write(RTPP_LOG_ERR, sp->log, "directory for shared memory taps is not configured");
+	return NULL;
+    }
+    tname = target + 4;
+    if (tname[0] == '\0' || strchr(tname, '/') != NULL ||
+      strcmp(tname, ".") == 0 || strcmp(tname, "..") == 0) {
+	rtpp_log_write(RTPP_LOG_ERR, sp->log, "invalid tap name %s", tname);
+	return NULL;
+    }
+    len = snprintf(path, sizeof(path), "%s/%s", cf->stable.tap_dir, tname);
+    if (len >= (int)sizeof(path)) {
+	rtpp_log_write(RTPP_LOG_ERR, sp->log, "tap file name is too long");
+	return NULL;
+    }
+    len = snprintf(name, sizeof(name), "%s=%s", sp->call_id, sp->tag);
+    if (len >= (int)sizeof(name) || strlen(target) >= sizeof(name)) {
+	rtpp_log_write(RTPP_LOG_ERR, sp->log, "recording name is too long");
+	return NULL;
+    }
+
+    rrc = malloc(sizeof(*rrc));
+    if (rrc == NULL) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't allocate memory");
+	return NULL;
+    }
+    memset(rrc, 0, sizeof(*rrc));
+    rrc->mode = MODE_REMOTE_SHM;
+    rrc->fd = -1;
+    rrc->refcnt = 1;
+    strcpy(rrc->spath, target);
+    rrc->tap = rtpp_tap_open(path, sp->log);
+    if (rrc->tap == NULL) {
+	free(rrc);
+	return NULL;
+    }
+    rrc->tap_sess = rtpp_tap_sess_id(rrc->tap);
+
+    rtap_rec(sp, rrc, NULL, RTPP_TAP_OPEN, len, &rec);
+    rtpp_tap_put(rrc->tap, &rec, name);
+    return rrc;
+}
+
 void *
 ropen(struct cfg *cf, struct rtpp_session *sp, char *rname, int orig)
 {
     struct rtpp_record_channel *rrc;
     const char *sdir;
     char *cp, *tmp;
-    int n, port, rval;
+    int n, port;
     struct sockaddr_storage raddr;
     pcap_hdr_t pcap_hdr;
+    struct rtpx_hdr rtpx_hdr;
+    unsigned char ng_hdr[512];
+    char fname[PATH_MAX + 1];
+
+    if (rname != NULL && (strncmp("tcp:", rname, 4) == 0 ||
+      strncmp("unix:", rname, 5) == 0)) {
+	rrc = rmux_find(sp, MODE_REMOTE_STREAM);
+	if (rrc != NULL) {
+	    rrc->refcnt++;
+	    return (void *)(rrc);
+	}
+	return (void *)(rstream_open(sp, rname));
+    }
+
+    if (rname != NULL && strncmp("shm:", rname, 4) == 0) {
+	rrc = rmux_find(sp, MODE_REMOTE_SHM);
+	if (rrc != NULL) {
+	    rrc->refcnt++;
+	    return (void *)(rrc);
+	}
+	return (void *)(rtap_open(cf, sp, rname));
+    }
+
+    if (cf->stable.record_mux != 0 && cf->stable.rdir != NULL &&
+      (rname == NULL || strncmp("udp:", rname, 4) != 0)) {
+	rrc = rmux_find(sp, MODE_LOCAL_MUX);
+	if (rrc != NULL) {
+	    rrc->refcnt++;
+	    return (void *)(rrc);
+	}
+    }
 
     rrc = malloc(sizeof(*rrc));
     if (rrc == NULL) {
@@ -136,32 +1229,52 @@ ropen(struct cfg *cf, struct rtpp_session *sp, char *rname, int orig)
 	return NULL;
     }
 
-    if (cf->stable.record_pcap != 0) {
+    if (cf->stable.record_mux != 0) {
+	rrc->mode = MODE_LOCAL_MUX;
+	rrc->refcnt = 1;
+    } else if (cf->stable.record_wav != 0 && sp->rtcp != NULL) {
+	rrc->mode = MODE_LOCAL_WAV;
+    } else if (cf->stable.record_pcapng != 0) {
+	rrc->mode = MODE_LOCAL_PCAPNG;
+    } else if (cf->stable.record_pcap != 0) {
 	rrc->mode = MODE_LOCAL_PCAP;
     } else {
 	rrc->mode = MODE_LOCAL_PKT;
     }
 
+    if (rrc->mode == MODE_LOCAL_MUX) {
+	if (rname == NULL) {
+	    snprintf(fname, sizeof(fname), "%s=%s.rtpx", sp->call_id, sp->tag);
+	} else {
+	    snprintf(fname, sizeof(fname), "%s.rtpx", rname);
+	}
+    } else if (rname == NULL) {
+	snprintf(fname, sizeof(fname), "%s=%s.%c.%s", sp->call_id, sp->tag,
+	  (orig != 0) ? 'o' : 'a', (rrc->mode == MODE_LOCAL_WAV) ? "wav" :
+	  (sp->rtcp != NULL) ? "rtp" : "rtcp");
+    } else {
+	snprintf(fname, sizeof(fname), "%s.%s", rname,
+	  (rrc->mode == MODE_LOCAL_WAV) ? "wav" :
+	  (sp->rtcp != NULL) ? "rtp" : "rtcp");
+    }
     if (cf->stable.sdir == NULL) {
 	sdir = cf->stable.rdir;
 	rrc->needspool = 0;
     } else {
 	sdir = cf->stable.sdir;
 	rrc->needspool = 1;
-	if (rname == NULL) {
-	    sprintf(rrc->rpath, "%s/%s=%s.%c.%s", cf->stable.rdir, sp->call_id, sp->tag,
-	      (orig != 0) ? 'o' : 'a', (sp->rtcp != NULL) ? "rtp" : "rtcp");
-	} else {
-	    sprintf(rrc->rpath, "%s/%s.%s", cf->stable.rdir, rname,
-	      (sp->rtcp != NULL) ? "rtp" : "rtcp");
+	if (snprintf(rrc->rpath, sizeof(rrc->rpath), "%s/%s", cf->stable.rdir,
+	  fname) >= (int)sizeof(rrc->rpath)) {
+	    rtpp_log_write(RTPP_LOG_ERR, sp->log, "recording file name is too long");
+	    free(rrc);
+	    return NULL;
 	}
     }
-    if (rname == NULL) {
-	sprintf(rrc->spath, "%s/%s=%s.%c.%s", sdir, sp->call_id, sp->tag,
-	  (orig != 0) ? 'o' : 'a', (sp->rtcp != NULL) ? "rtp" : "rtcp");
-    } else {
-	sprintf(rrc->spath, "%s/%s.%s", sdir, rname,
-	  (sp->rtcp != NULL) ? "rtp" : "rtcp");
+    if (snprintf(rrc->spath, sizeof(rrc->spath), "%s/%s", sdir, fname) >=
+      (int)sizeof(rrc->spath)) {
+	rtpp_log_write(RTPP_LOG_ERR, sp->log, "recording file name is too long");
+	free(rrc);
+	return NULL;
     }
     rrc->fd = open(rrc->spath, O_WRONLY | O_CREAT | O_TRUNC, DEFFILEMODE);
     if (rrc->fd == -1) {
@@ -171,6 +1284,16 @@ ropen(struct cfg *cf, struct rtpp_session *sp, char *rname, int orig)
 	return NULL;
     }
 
+    rrc->rbuf = rtpp_record_buf_get(1);
+    if (rrc->rbuf == NULL) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't allocate memory");
+	close(rrc->fd);
+	unlink(rrc->spath);
+	free(rrc);
+	return NULL;
+    }
+    rrc->rbuf->rrc = rrc;
+
     if (rrc->mode == MODE_LOCAL_PCAP) {
 	pcap_hdr.magic_number = PCAP_MAGIC;
 	pcap_hdr.version_major = PCAP_VER_MAJR;
@@ -179,45 +1302,26 @@ ropen(struct cfg *cf, struct rtpp_session *sp, char *rname, int orig)
 	pcap_hdr.sigfigs = 0;
 	pcap_hdr.snaplen = 65535;
 	pcap_hdr.network = DLT_NULL;
-	rval = write(rrc->fd, &pcap_hdr, sizeof(pcap_hdr));
-	if (rval == -1) {
-	    close(rrc->fd);
-	    rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "%s: error writing header",
-	      rrc->spath);
-	    free(rrc);
-	    return NULL;
-	}
-	if (rval < sizeof(pcap_hdr)) {
-	    close(rrc->fd);
-	    rtpp_log_write(RTPP_LOG_ERR, sp->log, "%s: short write writing header",
-	      rrc->spath);
-	    free(rrc);
-	    return NULL;
-	}
+	rrc_append(rrc, &pcap_hdr, sizeof(pcap_hdr), 1);
+    } else if (rrc->mode == MODE_LOCAL_PCAPNG) {
+	n = pcapng_file_hdr(sp, orig, ng_hdr, sizeof(ng_hdr));
+	if (n > 0)
+	    rrc_append(rrc, ng_hdr, n, 1);
+    } else if (rrc->mode == MODE_LOCAL_MUX) {
+	rtpx_hdr.magic = RTPX_MAGIC;
+	rtpx_hdr.version = RTPX_VERSION;
+	rtpx_hdr.nchans = RTPX_NCHANS;
+	rrc_append(rrc, &rtpx_hdr, sizeof(rtpx_hdr), 1);
+    } else if (rrc->mode == MODE_LOCAL_WAV) {
+	/* Header is rewritten with actual lengths on close */
+	rwav_hdr(rrc);
+	rrc_append(rrc, rrc->wav_hdr, WAV_HDR_LEN, 1);
+	rrc->offset = 0;
     }
 
     return (void *)(rrc);
 }
 
-static int
-flush_rbuf(struct rtpp_session *sp, void *rrc)
-{
-    int rval;
-
-    rval = write(RRC_CAST(rrc)->fd, RRC_CAST(rrc)->rbuf, RRC_CAST(rrc)->rbuf_len);
-    if (rval != -1) {
-	RRC_CAST(rrc)->rbuf_len = 0;
-	return 0;
-    }
-
-    rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "error while recording session (%s)",
-      (sp->rtcp != NULL) ? "RTP" : "RTCP");
-    /* Prevent futher writing if error happens */
-    close(RRC_CAST(rrc)->fd);
-    RRC_CAST(rrc)->fd = -1;
-    return -1;
-}
-
 static int
 prepare_pkt_hdr_adhoc(struct rtpp_session *sp, struct rtp_packet *packet, struct pkt_hdr_adhoc *hdrp)
 {
@@ -249,6 +1353,169 @@ prepare_pkt_hdr_adhoc(struct rtpp_session *sp, struct rtp_packet *packet, struct
     return 0;
 }
 
+/* Sum of 16-bit words of the data for the Internet checksum, not folded */
+static uint32_t
+pcapng_sum(const void *data, int len)
+{
+    const unsigned char *cp;
+    uint16_t w;
+    uint32_t sum;
+
+    sum = 0;
+    for (cp = data; len > 1; cp += 2, len -= 2) {
+	memcpy(&w, cp, sizeof(w));
+	sum += w;
+    }
+    if (len == 1) {
+	w = 0;
+	memcpy(&w, cp, 1);
+	sum += w;
+    }
+    return sum;
+}
+
+/* Prepare IP/UDP header template for the packets from the new source */
+static void
+pcapng_hdr_init(struct rtpp_record_channel *rrc, struct rtp_packet *packet)
+{
+    struct ip *iphdr;
+    struct ip6_hdr *ip6hdr;
+    struct udphdr *udphdr;
+    uint16_t words[sizeof(struct ip) / 2];
+    int i;
+
+    memset(rrc->ng_hdr, 0, sizeof(rrc->ng_hdr));
+    memcpy(&rrc->ng_src, &packet->raddr, sizeof(rrc->ng_src));
+    if (sstosa(&packet->raddr)->sa_family == AF_INET) {
+	iphdr = (struct ip *)rrc->ng_hdr;
+	iphdr->ip_v = 4;
+	iphdr->ip_hl = sizeof(*iphdr) >> 2;
+	iphdr->ip_src = satosin(&packet->raddr)->sin_addr;
+	iphdr->ip_dst = satosin(packet->laddr)->sin_addr;
+	iphdr->ip_p = IPPROTO_UDP;
+	iphdr->ip_ttl = 127;
+	udphdr = (struct udphdr *)(iphdr + 1);
+	udphdr->uh_sport = satosin(&packet->raddr)->sin_port;
+	udphdr->uh_dport = htons(packet->rport);
+	rrc->ng_hdr_len = sizeof(*iphdr) + sizeof(*udphdr);
+	/* Partial checksum of everything but the length */
+	memcpy(words, iphdr, sizeof(words));
+	rrc->ng_sum = 0;
+	for (i = 0; i < (int)(sizeof(words) / 2); i++)
+	    rrc->ng_sum += words[i];
+    } else {
+	ip6hdr = (struct ip6_hdr *)rrc->ng_hdr;
+	ip6hdr->ip6_vfc = 6 << 4;
+	ip6hdr->ip6_nxt = IPPROTO_UDP;
+	ip6hdr->ip6_hlim = 127;
+	ip6hdr->ip6_src = satosin6(&packet->raddr)->sin6_addr;
+	ip6hdr->ip6_dst = satosin6(packet->laddr)->sin6_addr;
+	udphdr = (struct udphdr *)(ip6hdr + 1);
+	udphdr->uh_sport = satosin6(&packet->raddr)->sin6_port;
+	udphdr->uh_dport = htons(packet->rport);
+	rrc->ng_hdr_len = sizeof(*ip6hdr) + sizeof(*udphdr);
+	/*
+	 * UDP checksum is mandatory over IPv6, partial sum of the pseudo
+	 * header and ports, the length and payload are added per packet.
+	 */
+	rrc->ng_sum = pcapng_sum(&ip6hdr->ip6_src, 2 * sizeof(struct in6_addr)) +
+	  htons(IPPROTO_UDP) + udphdr->uh_sport + udphdr->uh_dport;
+    }
+}
+
+static int
+pcapng_pkt_size(struct rtp_packet *packet)
+{
+    int len;
+
+    len = sizeof(struct udphdr) + packet->size;
+    if (sstosa(&packet->raddr)->sa_family == AF_INET)
+	len += sizeof(struct ip);
+    else
+	len += sizeof(struct ip6_hdr);
+    return len;
+}
+
+/*
+ * Put Enhanced Packet Block header and IP/UDP header of the packet, the
+ * caller adds packet itself and pcapng_pkt_trailer().
+ */
+static int
+prepare_pkt_hdr_pcapng(struct rtpp_session *sp, struct rtpp_record_channel *rrc,
+  struct rtp_packet *packet, unsigned char *bp)
+{
+    struct pcapng_epb_hdr epb;
+    uint64_t ts;
+    uint32_t sum;
+    uint16_t len, cksum;
+    int plen;
+
+    if (packet->rtime == -1) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't get current time");
+	return -1;
+    }
+
+    if (rrc->ng_hdr_len == 0 || memcmp(&rrc->ng_src, &packet->raddr,
+      SA_LEN(sstosa(&packet->raddr))) != 0)
+	pcapng_hdr_init(rrc, packet);
+
+    plen = pcapng_pkt_size(packet);
+    ts = (uint64_t)packet->rtime * 1000000000ULL +
+      (uint64_t)((packet->rtime - (uint64_t)packet->rtime) * 1e9);
+    epb.block_type = PCAPNG_BT_EPB;
+    epb.block_len = sizeof(epb) + ((plen + 3) & ~3) + sizeof(uint32_t);
+    epb.interface_id = 0;
+    epb.ts_high = ts >> 32;
+    epb.ts_low = ts & 0xffffffff;
+    epb.caplen = epb.origlen = plen;
+    memcpy(bp, &epb, sizeof(epb));
+    bp += sizeof(epb);
+
+    memcpy(bp, rrc->ng_hdr, rrc->ng_hdr_len);
+    if (sstosa(&packet->raddr)->sa_family == AF_INET) {
+	len = htons(plen);
+	memcpy(bp + offsetof(struct ip, ip_len), &len, sizeof(len));
+	sum = rrc->ng_sum + len;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	cksum = ~sum;
+	memcpy(bp + offsetof(struct ip, ip_sum), &cksum, sizeof(cksum));
+	bp += sizeof(struct ip);
+    } else {
+	len = htons(plen - sizeof(struct ip6_hdr));
+	memcpy(bp + offsetof(struct ip6_hdr, ip6_plen), &len, sizeof(len));
+	bp += sizeof(struct ip6_hdr);
+	/* Length is in both the pseudo header and the UDP header */
+	sum = rrc->ng_sum + len + len + pcapng_sum(packet->data.buf,
+	  packet->size);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	cksum = ~sum;
+	if (cksum == 0)
+	    cksum = 0xffff;
+	memcpy(bp + offsetof(struct udphdr, uh_sum), &cksum, sizeof(cksum));
+    }
+    len = htons(sizeof(struct udphdr) + packet->size);
+    memcpy(bp + offsetof(struct udphdr, uh_ulen), &len, sizeof(len));
+
+    return 0;
+}
+
+/* Pad packet data to 32 bits and close the block */
+static int
+pcapng_pkt_trailer(struct rtp_packet *packet, unsigned char *bp)
+{
+    uint32_t block_len;
+    int plen, pad;
+
+    plen = pcapng_pkt_size(packet);
+    pad = ((plen + 3) & ~3) - plen;
+    memset(bp, 0, pad);
+    block_len = sizeof(struct pcapng_epb_hdr) + plen + pad + sizeof(block_len);
+    memcpy(bp + pad, &block_len, sizeof(block_len));
+    return pad + sizeof(block_len);
+}
+
 static uint16_t ip_id = 0;
 
 static int
@@ -291,91 +1558,197 @@ prepare_pkt_hdr_pcap(struct rtpp_session *sp, struct rtp_packet *packet, struct
     return 0;
 }
 
+static int
+prepare_pkt_hdr_mux(struct rtpp_session *sp, struct rtp_packet *packet, void *hdrp)
+{
+    struct rtpx_rec_hdr hdr;
+    uint32_t ts_sec, ts_usec;
+
+    if (packet->rtime == -1) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't get current time");
+	return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.chan = rmux_chan(sp, packet);
+    hdr.family = sstosa(&packet->raddr)->sa_family;
+    hdr.plen = packet->size;
+    dtime2ts(packet->rtime, &ts_sec, &ts_usec);
+    hdr.ts_sec = ts_sec;
+    hdr.ts_usec = ts_usec;
+    switch (hdr.family) {
+    case AF_INET:
+	hdr.port = satosin(&packet->raddr)->sin_port;
+	memcpy(hdr.addr, &satosin(&packet->raddr)->sin_addr, 4);
+	break;
+
+    case AF_INET6:
+	hdr.port = satosin6(&packet->raddr)->sin6_port;
+	memcpy(hdr.addr, &satosin6(&packet->raddr)->sin6_addr, 16);
+	break;
+
+    default:
+	abort();
+    }
+
+    /* Buffer doesn't guarantee any alignment */
+    memcpy(hdrp, &hdr, sizeof(hdr));
+    return 0;
+}
+
 void
 rwrite(struct rtpp_session *sp, void *rrc, struct rtp_packet *packet)
 {
-    struct iovec v[2];
-    union {
-	struct pkt_hdr_pcap pcap;
-	struct pkt_hdr_adhoc adhoc;
-    } hdr;
-    int rval, hdr_size;
+    struct rtpp_record_buf *buf;
+    struct rtpp_tap_rec rec;
+    int hdr_size, trl_size;
     int (*prepare_pkt_hdr)(struct rtpp_session *, struct rtp_packet *, void *);
 
-    if (RRC_CAST(rrc)->fd == -1)
-	return;
-
+    trl_size = 0;
     switch (RRC_CAST(rrc)->mode) {
     case MODE_REMOTE_RTP:
-	send(RRC_CAST(rrc)->fd, packet->data.buf, packet->size, 0);
+	if (RRC_CAST(rrc)->fd != -1)
+	    send(RRC_CAST(rrc)->fd, packet->data.buf, packet->size, 0);
+	return;
+
+    case MODE_LOCAL_WAV:
+	if (RRC_CAST(rrc)->failed == 0)
+	    rwav_write(sp, RRC_CAST(rrc), packet);
+	return;
+
+    case MODE_REMOTE_SHM:
+	rtap_rec(sp, RRC_CAST(rrc), packet, RTPP_TAP_PKT, packet->size, &rec);
+	rtpp_tap_put(RRC_CAST(rrc)->tap, &rec, packet->data.buf);
 	return;
 
     case MODE_LOCAL_PKT:
-	hdr_size = sizeof(hdr.adhoc);
+	hdr_size = sizeof(struct pkt_hdr_adhoc);
 	prepare_pkt_hdr = (void *)&prepare_pkt_hdr_adhoc;
 	break;
 
     case MODE_LOCAL_PCAP:
-	hdr_size = sizeof(hdr.pcap);
+	hdr_size = sizeof(struct pkt_hdr_pcap);
 	prepare_pkt_hdr = (void *)&prepare_pkt_hdr_pcap;
 	break;
-    }
 
-    /* Check if the write buffer has necessary space, and flush if not */
-    if ((RRC_CAST(rrc)->rbuf_len + hdr_size + packet->size > sizeof(RRC_CAST(rrc)->rbuf)) && RRC_CAST(rrc)->rbuf_len > 0)
-	if (flush_rbuf(sp, rrc) != 0)
-	    return;
+    case MODE_LOCAL_MUX:
+    case MODE_REMOTE_STREAM:
+	hdr_size = sizeof(struct rtpx_rec_hdr);
+	prepare_pkt_hdr = &prepare_pkt_hdr_mux;
+	break;
 
-    /* Check if received packet doesn't fit into the buffer, do synchronous write  if so */
-    if (RRC_CAST(rrc)->rbuf_len + hdr_size + packet->size > sizeof(RRC_CAST(rrc)->rbuf)) {
-	if (prepare_pkt_hdr(sp, packet, (void *)&hdr) != 0)
-	    return;
+    case MODE_LOCAL_PCAPNG:
+	hdr_size = sizeof(struct pcapng_epb_hdr) + pcapng_pkt_size(packet) -
+	  packet->size;
+	/* Padding and block length */
+	trl_size = 3 + sizeof(uint32_t);
+	prepare_pkt_hdr = NULL;
+	break;
+    }
 
-	v[0].iov_base = (void *)&hdr;
-	v[0].iov_len = hdr_size;
-	v[1].iov_base = packet->data.buf;
-	v[1].iov_len = packet->size;
+    if (RRC_CAST(rrc)->failed != 0)
+	return;
 
-	rval = writev(RRC_CAST(rrc)->fd, v, 2);
-	if (rval != -1)
+    /* Hand the buffer over to the writer if the packet doesn't fit */
+    buf = RRC_CAST(rrc)->rbuf;
+    if (buf != NULL &&
+      buf->len + hdr_size + packet->size + trl_size > RRC_BUF_SIZE) {
+	rtpp_record_queue_put_buf(buf);
+	buf = RRC_CAST(rrc)->rbuf = NULL;
+    }
+    if (buf == NULL) {
+	if (RRC_CAST(rrc)->mode != MODE_REMOTE_STREAM ||
+	  rtpp_record_queue_len(RRC_CAST(rrc)) < RRS_MAX_BUFS)
+	    buf = rtpp_record_buf_get(0);
+	if (buf == NULL) {
+	    RRC_CAST(rrc)->ndropped++;
 	    return;
+	}
+	buf->rrc = RRC_CAST(rrc);
+	RRC_CAST(rrc)->rbuf = buf;
+    }
 
-	rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "error while recording session (%s)",
-	  (sp->rtcp != NULL) ? "RTP" : "RTCP");
-	/* Prevent futher writing if error happens */
-	close(RRC_CAST(rrc)->fd);
-	RRC_CAST(rrc)->fd = -1;
+    if (prepare_pkt_hdr == NULL) {
+	if (prepare_pkt_hdr_pcapng(sp, RRC_CAST(rrc), packet,
+	  buf->data + buf->len) != 0)
+	    return;
+    } else if (prepare_pkt_hdr(sp, packet, (void *)(buf->data + buf->len)) != 0) {
 	return;
     }
-    if (prepare_pkt_hdr(sp, packet, (void *)(RRC_CAST(rrc)->rbuf + RRC_CAST(rrc)->rbuf_len)) != 0)
-	return;
-    RRC_CAST(rrc)->rbuf_len += hdr_size;
-    memcpy(RRC_CAST(rrc)->rbuf + RRC_CAST(rrc)->rbuf_len, packet->data.buf, packet->size);
-    RRC_CAST(rrc)->rbuf_len += packet->size;
+    if (RRC_CAST(rrc)->mode == MODE_LOCAL_MUX ||
+      RRC_CAST(rrc)->mode == MODE_REMOTE_STREAM) {
+	if (packet->rtime - RRC_CAST(rrc)->idx_last >= RTPX_IDX_IVAL)
+	    rmux_index(RRC_CAST(rrc), packet->rtime);
+	RRC_CAST(rrc)->npkts[rmux_chan(sp, packet)]++;
+    }
+    buf->len += hdr_size;
+    memcpy(buf->data + buf->len, packet->data.buf, packet->size);
+    buf->len += packet->size;
+    if (RRC_CAST(rrc)->mode == MODE_LOCAL_PCAPNG) {
+	trl_size = pcapng_pkt_trailer(packet, buf->data + buf->len);
+	buf->len += trl_size;
+    }
+    RRC_CAST(rrc)->offset += hdr_size + packet->size + trl_size;
+
+    /* Don't let streamed data sit in the buffer for too long */
+    if (RRC_CAST(rrc)->mode == MODE_REMOTE_STREAM &&
+      packet->rtime - RRC_CAST(rrc)->flush_time >= RRS_FLUSH_IVAL) {
+	rtpp_record_queue_put_buf(buf);
+	RRC_CAST(rrc)->rbuf = NULL;
+	RRC_CAST(rrc)->flush_time = packet->rtime;
+    }
 }
 
 void
 rclose(struct rtpp_session *sp, void *rrc, int keep)
 {
+    struct rtpp_record_buf *buf;
+    struct rtpp_tap_rec rec;
 
-    if (RRC_CAST(rrc)->mode != MODE_REMOTE_RTP && RRC_CAST(rrc)->rbuf_len > 0)
-	flush_rbuf(sp, rrc);
-
-    if (RRC_CAST(rrc)->fd != -1)
-	close(RRC_CAST(rrc)->fd);
+    if (RRC_CAST(rrc)->mode == MODE_REMOTE_RTP) {
+	if (RRC_CAST(rrc)->fd != -1)
+	    close(RRC_CAST(rrc)->fd);
+	free(rrc);
+	return;
+    }
 
-    if (RRC_CAST(rrc)->mode == MODE_REMOTE_RTP)
+    if (RRC_CAST(rrc)->mode == MODE_REMOTE_SHM) {
+	RRC_CAST(rrc)->refcnt--;
+	if (RRC_CAST(rrc)->refcnt > 0)
+	    return;
+	rtap_rec(sp, RRC_CAST(rrc), NULL, RTPP_TAP_CLOSE, 0, &rec);
+	rtpp_tap_put(RRC_CAST(rrc)->tap, &rec, NULL);
+	free(rrc);
 	return;
+    }
 
-    if (keep == 0) {
-	if (unlink(RRC_CAST(rrc)->spath) == -1)
-	    rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't remove "
+    if (RRC_CAST(rrc)->mode == MODE_LOCAL_MUX ||
+      RRC_CAST(rrc)->mode == MODE_REMOTE_STREAM) {
+	/* Keep the file if any of the channels wants it */
+	RRC_CAST(rrc)->keep |= keep;
+	RRC_CAST(rrc)->refcnt--;
+	if (RRC_CAST(rrc)->refcnt > 0)
+	    return;
+	keep = RRC_CAST(rrc)->keep;
+	if (rmux_finish(RRC_CAST(rrc)) != 0)
+	    rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't write index of "
 	      "session record %s", RRC_CAST(rrc)->spath);
-    } else if (RRC_CAST(rrc)->needspool == 1) {
-	if (rename(RRC_CAST(rrc)->spath, RRC_CAST(rrc)->rpath) == -1)
-	    rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't move "
-	      "session record from spool into permanent storage");
     }
 
-    free(rrc);
+    if (RRC_CAST(rrc)->mode == MODE_LOCAL_WAV)
+	rwav_hdr(RRC_CAST(rrc));
+
+    /* Writer closes the file and frees the channel once data is written */
+    buf = RRC_CAST(rrc)->rbuf;
+    if (buf == NULL) {
+	buf = rtpp_record_buf_get(1);
+	if (buf == NULL) {
+	    rtpp_log_ewrite(RTPP_LOG_ERR, sp->log, "can't allocate memory");
+	    return;
+	}
+	buf->rrc = RRC_CAST(rrc);
+    }
+    RRC_CAST(rrc)->rbuf = NULL;
+    buf->op = (keep == 0) ? RRB_REMOVE : RRB_CLOSE;
+    rtpp_record_queue_put_buf(buf);
 }
@@ -34,6 +34,7 @@
 #include <netinet/in.h>
 #include <netinet/in_systm.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/udp.h>
 
 #include "rtpp_defines.h"
@@ -45,12 +46,31 @@
 #define	PCAP_VER_MAJR	2
 #define	PCAP_VER_MINR	4
 
+/*
+ * pcapng, see draft-tuexen-opsawg-pcapng. Each recording has one
+ * section with a single raw IP interface, packets are stored in the
+ * Enhanced Packet Blocks with nanosecond timestamps.
+ */
+#define	PCAPNG_BT_SHB		0x0a0d0d0a
+#define	PCAPNG_BT_IDB		0x00000001
+#define	PCAPNG_BT_EPB		0x00000006
+#define	PCAPNG_BOM		0x1a2b3c4d
+#define	PCAPNG_VER_MAJR		1
+#define	PCAPNG_VER_MINR		0
+#define	PCAPNG_OPT_ENDOFOPT	0
+#define	PCAPNG_OPT_COMMENT	1
+#define	PCAPNG_OPT_SHB_USERAPPL	4
+#define	PCAPNG_OPT_IF_NAME	2
+#define	PCAPNG_OPT_IF_TSRESOL	9
+#define	LINKTYPE_RAW		101
+
 struct rtpp_session;
 
 /* Function prototypes */
 void *ropen(struct cfg *cf, struct rtpp_session *, char *, int);
 void rwrite(struct rtpp_session *, void *, struct rtp_packet *);
 void rclose(struct rtpp_session *, void *, int);
+int rtpp_record_init(rtpp_log_t);
 
 /* Global PCAP Header */
 typedef struct pcap_hdr_s {
@@ -81,6 +101,96 @@ struct pkt_hdr_pcap {
     struct udphdr udphdr;
 } __attribute__((__packed__));
 
+/*
+ * Multiplexed recording: all channels of the session (RTP and RTCP
+ * received from either leg) are stored in a single file. File starts
+ * with the rtpx_hdr followed by records, each being rtpx_rec_hdr and
+ * the RTP/RTCP packet itself. Index of seek points and the trailer are
+ * appended when the recording is closed, so that the trailer is the last
+ * thing in the file. All fields are in the host byte order, except for
+ * the address and port, which are in the network byte order.
+ */
+#define	RTPX_MAGIC	0x52545058	/* "RTPX" */
+#define	RTPX_TMAGIC	0x52545849	/* "RTXI" */
+#define	RTPX_VERSION	1
+
+/* Channel tag bits */
+#define	RTPX_CHAN_ORIG	0x1	/* Received from the caller */
+#define	RTPX_CHAN_RTCP	0x2	/* RTCP rather than RTP */
+#define	RTPX_NCHANS	4
+
+/* Interval between seek points in the index, in seconds */
+#define	RTPX_IDX_IVAL	1.0
+
+struct rtpx_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t nchans;
+} __attribute__((__packed__));
+
+struct rtpx_rec_hdr {
+    uint8_t chan;		/* Channel tag */
+    uint8_t family;		/* Address family of the source */
+    uint16_t plen;		/* Length of following RTP/RTCP packet */
+    uint16_t port;		/* Source port */
+    uint16_t pad;
+    uint32_t ts_sec;		/* Time of arrival */
+    uint32_t ts_usec;
+    uint8_t addr[16];		/* Source address */
+} __attribute__((__packed__));
+
+struct rtpx_idx_ent {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint64_t offset;		/* Offset of the first record after the time */
+} __attribute__((__packed__));
+
+/*
+ * Streamed recording: multiplexed recording of the session is sent to
+ * the collector over a TCP or Unix domain stream connection given as
+ * tcp:host:port (tcp:[addr]:port for IPv6) or unix:path instead of the
+ * recording name. Stream starts with rtpx_stream_hdr followed by the
+ * name of the recording (call_id=tag, not NUL-terminated), the rest of
+ * it is the same as the content of the .rtpx file, connection is closed
+ * after the trailer.
+ */
+#define	RTPX_SMAGIC	0x52545053	/* "RTPS" */
+
+struct rtpx_stream_hdr {
+    uint32_t magic;
+    uint16_t name_len;
+} __attribute__((__packed__));
+
+struct rtpx_trailer {
+    uint64_t idx_offset;	/* Offset of the first index entry */
+    uint32_t idx_nents;
+    uint32_t npkts[RTPX_NCHANS];	/* Number of packets per channel */
+    uint32_t magic;
+} __attribute__((__packed__));
+
+/*
+ * G.711 WAV recording: payload of RTP packets received from each party
+ * is placed at its RTP timestamp offset with gaps filled with silence,
+ * the header is updated with the actual length when the recording is
+ * closed.
+ */
+#define	WAV_FMT_ALAW	6
+#define	WAV_FMT_ULAW	7
+#define	WAV_HDR_LEN	58
+/* Timestamps are re-anchored to the arrival time if that far off */
+#define	WAV_RESYNC	8000
+
+/* Enhanced Packet Block header, followed by packet, padding and length */
+struct pcapng_epb_hdr {
+    uint32_t block_type;
+    uint32_t block_len;
+    uint32_t interface_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t origlen;
+};
+
 struct pkt_hdr_adhoc {
     union sockaddr_in_s addr;   /* Source address */
     double time;		/* Time of arrival */
@@ -38,7 +38,9 @@
 #include <unistd.h>
 
 #include "rtpp_defines.h"
+#include "rtpp_fork.h"
 #include "rtpp_log.h"
+#include "rtpp_preroll.h"
 #include "rtpp_record.h"
 #include "rtpp_session.h"
 #include "rtpp_util.h"
@@ -68,7 +70,7 @@ dump_hash_table(struct cfg_stable *cfs)
     }
 }
 
-static uint8_t
+uint8_t
 hash_string(struct cfg_stable *cf, const char *bp, const char *ep)
 {
     uint8_t res;
@@ -227,14 +229,26 @@ remove_session(struct cfg *cf, struct rtpp_session *sp)
 	    rclose(sp, sp->rrcs[i], 1);
 	if (sp->rtcp->rrcs[i] != NULL)
 	    rclose(sp, sp->rtcp->rrcs[i], 1);
-	if (sp->rtps[i] != NULL) {
-	    cf->rtp_servers[sp->sridx] = NULL;
-	    rtp_server_free(sp->rtps[i]);
-	}
+	if (sp->preroll[i] != NULL)
+	    rtpp_preroll_free(sp->preroll[i]);
+	if (sp->rtcp->preroll[i] != NULL)
+	    rtpp_preroll_free(sp->rtcp->preroll[i]);
+	if (sp->forks[i] != NULL)
+	    rtpp_fork_free(sp->forks[i]);
+	if (sp->rtcp->forks[i] != NULL)
+	    rtpp_fork_free(sp->rtcp->forks[i]);
+	if (sp->rtps[i] != NULL)
+	    rtp_server_unsubscribe(cf, sp->rtps[i], sp, i);
 	if (sp->codecs[i] != NULL)
 	    free(sp->codecs[i]);
 	if (sp->rtcp->codecs[i] != NULL)
 	    free(sp->rtcp->codecs[i]);
+	if (sp->rtpmap[i] != NULL)
+	    free(sp->rtpmap[i]);
+	if (sp->rtpm[i] != NULL)
+	    rtp_mixer_leave(cf, sp->rtpm[i]);
+	if (sp->dtmf[i] != NULL)
+	    free(sp->dtmf[i]);
     }
     if (sp->timeout_data.notify_tag != NULL)
 	free(sp->timeout_data.notify_tag);
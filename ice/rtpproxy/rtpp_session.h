@@ -32,6 +32,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include "rtp_mixer.h"
+#include "rtp_normalizer.h"
 #include "rtp_server.h"
 #include "rtp_resizer.h"
 #include "rtpp_log.h"
@@ -71,13 +73,17 @@ struct rtpp_session {
     /* Pointers to rtpp_record's opaque data type */
     void *rrcs[2];
     struct rtp_server *rtps[2];
+    /* Recent packets kept in case recording is requested later */
+    struct rtpp_preroll *preroll[2];
+    /* Additional destinations the stream is forked to */
+    struct rtpp_fork *forks[2];
     /* References to fd-to-session table */
     int sidx[2];
-    /* Reference to active RTP generators table */
-    int sridx;
     /* Flag that indicates whether or not address supplied by client can't be trusted */
     int untrusted_addr[2];
     struct rtp_resizer resizers[2];
+    /* Keep streams sent to each leg continuous across source switches */
+    struct rtp_normalizer normalizers[2];
     struct rtpp_session *prev;
     struct rtpp_session *next;
     struct rtpp_timeout_data timeout_data;
@@ -85,9 +91,18 @@ struct rtpp_session {
     double last_update[2];
     /* Supported codecs */
     char *codecs[2];
+    /* Payload type to codec bindings */
+    struct rtp_codec_map *rtpmap[2];
+    /* G.711 encoding to convert packets sent to each leg into */
+    const struct rtp_codec *xcode[2];
+    /* Conference mixer legs */
+    struct rtp_mixer_leg *rtpm[2];
+    /* DTMF detectors, only allocated if reporting is requested */
+    struct rtp_dtmf *dtmf[2];
 };
 
 void init_hash_table(struct cfg_stable *);
+uint8_t hash_string(struct cfg_stable *, const char *, const char *);
 void dump_hash_table(struct cfg_stable *);
 struct rtpp_session *session_findfirst(struct cfg *, const char *);
 struct rtpp_session *session_findnext(struct cfg *cf, struct rtpp_session *);
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rtpp_log.h"
+#include "rtpp_tap.h"
+
+struct rtpp_tap {
+    char *path;
+    struct rtpp_tap_hdr *hdr;
+    unsigned char *ring;
+    uint64_t seq;
+    uint64_t sess_id;
+    struct rtpp_tap *next;
+};
+
+/*
+ * Taps stay mapped once opened, so that consumers don't have to reattach
+ * when no session is copied to the tap for a while.
+ */
+static struct rtpp_tap *rtpp_taps;
+
+/*
+ * Check that the existing file is a tap left by us, so that anything
+ * else is never truncated and overwritten.
+ */
+static int
+rtpp_tap_check(int fd)
+{
+    struct rtpp_tap_hdr hdr;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_uid != geteuid())
+	return -1;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != RTPP_TAP_MAGIC)
+	return -1;
+    return 0;
+}
+
+/* Find tap by path or create it, resetting the ring */
+struct rtpp_tap *
+rtpp_tap_open(const char *path, rtpp_log_t log)
+{
+    struct rtpp_tap *tap;
+    void *p;
+    size_t len;
+    int fd;
+
+    for (tap = rtpp_taps; tap != NULL; tap = tap->next)
+	if (strcmp(tap->path, path) == 0)
+	    return tap;
+
+    tap = malloc(sizeof(*tap));
+    if (tap == NULL) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, log, "can't allocate memory");
+	return NULL;
+    }
+    memset(tap, 0, sizeof(*tap));
+    tap->path = strdup(path);
+    if (tap->path == NULL) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, log, "can't allocate memory");
+	free(tap);
+	return NULL;
+    }
+
+    len = sizeof(struct rtpp_tap_hdr) + RTPP_TAP_SIZE;
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW,
+      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1 && errno == EEXIST) {
+	fd = open(path, O_RDWR | O_NOFOLLOW);
+	if (fd != -1 && rtpp_tap_check(fd) != 0) {
+	    rtpp_log_write(RTPP_LOG_ERR, log, "%s exists and isn't a tap, "
+	      "refusing to overwrite it", path);
+	    goto e1;
+	}
+    }
+    if (fd == -1) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, log, "can't open tap %s", path);
+	goto e0;
+    }
+    if (ftruncate(fd, len) == -1) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, log, "can't resize tap %s", path);
+	goto e1;
+    }
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+	rtpp_log_ewrite(RTPP_LOG_ERR, log, "can't map tap %s", path);
+	goto e1;
+    }
+    close(fd);
+
+    tap->hdr = p;
+    tap->ring = (unsigned char *)p + sizeof(struct rtpp_tap_hdr);
+    /* Consumers check magic last */
+    tap->hdr->magic = 0;
+    __sync_synchronize();
+    tap->hdr->version = RTPP_TAP_VERSION;
+    tap->hdr->hdr_len = sizeof(struct rtpp_tap_hdr);
+    tap->hdr->size = RTPP_TAP_SIZE;
+    tap->hdr->head = 0;
+    tap->hdr->reserved = 0;
+    __sync_synchronize();
+    tap->hdr->magic = RTPP_TAP_MAGIC;
+
+    tap->next = rtpp_taps;
+    rtpp_taps = tap;
+    return tap;
+
+e1:
+    close(fd);
+e0:
+    free(tap->path);
+    free(tap);
+    return NULL;
+}
+
+/* Allocate identifier for the session starting to use the tap */
+uint64_t
+rtpp_tap_sess_id(struct rtpp_tap *tap)
+{
+
+    return ++tap->sess_id;
+}
+
+/*
+ * Append record followed by rec->plen bytes of data to the ring, the len,
+ * seq and pad fields of the record are filled in here.
+ */
+void
+rtpp_tap_put(struct rtpp_tap *tap, struct rtpp_tap_rec *rec, const void *data)
+{
+    struct rtpp_tap_hdr *hdr;
+    struct rtpp_tap_rec *pad;
+    uint64_t head;
+    uint32_t len, pos;
+
+    hdr = tap->hdr;
+    len = RTPP_TAP_ALIGN(sizeof(*rec) + rec->plen);
+    head = hdr->head;
+    pos = head % RTPP_TAP_SIZE;
+    if (RTPP_TAP_SIZE - pos < len) {
+	hdr->reserved = head + (RTPP_TAP_SIZE - pos) + len;
+	__sync_synchronize();
+	pad = (struct rtpp_tap_rec *)(tap->ring + pos);
+	pad->len = RTPP_TAP_SIZE - pos;
+	pad->type = RTPP_TAP_PAD;
+	head += RTPP_TAP_SIZE - pos;
+	pos = 0;
+    } else {
+	hdr->reserved = head + len;
+	__sync_synchronize();
+    }
+
+    rec->len = len;
+    rec->seq = tap->seq++;
+    rec->pad = 0;
+    memcpy(tap->ring + pos, rec, sizeof(*rec));
+    if (rec->plen > 0)
+	memcpy(tap->ring + pos + sizeof(*rec), data, rec->plen);
+    __sync_synchronize();
+    hdr->head = head + len;
+}
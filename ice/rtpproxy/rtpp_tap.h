@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2010 Sippy Software, Inc., http://www.sippysoft.com
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RTPP_TAP_H_
+#define _RTPP_TAP_H_
+
+#include <stdint.h>
+
+/*
+ * Media tap: packets of the sessions being copied to the shm:name target
+ * are appended to the ring in the file of that name in the tap directory
+ * (-k), which should be on the memory backed file system such as
+ * /dev/shm, so that consumers on the same host can map it and read
+ * packets without any system calls on either side. There is one ring per
+ * name, shared by all sessions copied to it; every session starts with
+ * the RTPP_TAP_OPEN record carrying its name (call_id=tag) and ends with
+ * RTPP_TAP_CLOSE. All fields are in the host byte order, except for the
+ * address and port, which are in the network byte order.
+ *
+ * The file starts with rtpp_tap_hdr, followed by the ring of the given
+ * size. Offsets in the header only grow, position in the ring is the
+ * offset modulo size. Records are aligned at 8 bytes and never wrap
+ * around the end of the ring, RTPP_TAP_PAD record fills the space left
+ * before it instead. Writer never waits for consumers, it moves reserved
+ * past the record before writing it and head once it's complete. To read,
+ * the consumer starts at the current head and for each record before the
+ * head copies it, then checks that reserved is still no more than size
+ * ahead of the record's offset, otherwise the record has been overwritten
+ * and the consumer has to start over from the current head. Records lost
+ * this way are accounted for by gaps in the record numbers.
+ *
+ * The file is created readable by everyone but writable by the owner
+ * only and must not be truncated while in use. An existing file is only
+ * reused if it's a tap already.
+ */
+#define	RTPP_TAP_MAGIC		0x52545054	/* "RTPT" */
+#define	RTPP_TAP_VERSION	1
+#define	RTPP_TAP_SIZE		(4 * 1024 * 1024)
+
+#define	RTPP_TAP_PAD		0
+#define	RTPP_TAP_OPEN		1
+#define	RTPP_TAP_PKT		2
+#define	RTPP_TAP_CLOSE		3
+
+#define	RTPP_TAP_ALIGN(x)	(((x) + 7) & ~7)
+
+struct rtpp_tap_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t hdr_len;		/* Offset of the ring in the file */
+    uint32_t size;		/* Size of the ring */
+    uint32_t pad;
+    volatile uint64_t head;	/* End of the last complete record */
+    volatile uint64_t reserved;	/* End of the record being written */
+};
+
+struct rtpp_tap_rec {
+    uint32_t len;		/* Length of the record, padding included */
+    uint16_t type;
+    uint8_t chan;		/* Channel tag, RTPX_CHAN_* bits */
+    uint8_t family;		/* Address family of the source */
+    uint64_t seq;		/* Record number */
+    uint64_t sess_id;		/* Session the record belongs to */
+    uint32_t ts_sec;		/* Time of arrival */
+    uint32_t ts_usec;
+    uint16_t port;		/* Source port */
+    uint16_t plen;		/* Length of following data */
+    uint32_t pad;
+    uint8_t addr[16];		/* Source address */
+};
+
+struct rtpp_tap;
+
+struct rtpp_tap *rtpp_tap_open(const char *, rtpp_log_t);
+uint64_t rtpp_tap_sess_id(struct rtpp_tap *);
+void rtpp_tap_put(struct rtpp_tap *, struct rtpp_tap_rec *, const void *);
+
+#endif